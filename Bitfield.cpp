@@ -0,0 +1,129 @@
+#include "Bitfield.h"
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+Bitfield::Bitfield(size_t n, bool value) : bits((n + 63) / 64, value ? ~uint64_t(0) : 0), numBits(n) {
+    clearTail();
+}
+
+Bitfield Bitfield::fromBytes(const unsigned char* data, size_t len, size_t n) {
+    Bitfield out(n);
+    size_t nbytes = std::min(len, out.byteSize());
+
+    // straight copy of the wire bytes, then each word is fixed up from big-endian
+    memcpy(out.bits.data(), data, nbytes);
+    for (uint64_t& w : out.bits) w = be64toh(w);
+
+    out.clearTail();
+    return out;
+}
+
+void Bitfield::toBytes(unsigned char* out) const {
+    size_t nbytes = byteSize();
+    size_t full = nbytes / 8;
+    for (size_t i = 0; i < full; ++i) {
+        uint64_t w = htobe64(bits[i]);
+        memcpy(out + i * 8, &w, 8);
+    }
+    if (full < bits.size()) {
+        uint64_t w = htobe64(bits[full]);
+        memcpy(out + full * 8, &w, nbytes - full * 8);
+    }
+}
+
+std::vector<unsigned char> Bitfield::toBytes() const {
+    std::vector<unsigned char> out(byteSize());
+    toBytes(out.data());
+    return out;
+}
+
+void Bitfield::resize(size_t n) {
+    bits.resize((n + 63) / 64, 0);
+    numBits = n;
+    clearTail();
+}
+
+void Bitfield::setAll(bool value) {
+    std::fill(bits.begin(), bits.end(), value ? ~uint64_t(0) : 0);
+    clearTail();
+}
+
+size_t Bitfield::count() const {
+    size_t total = 0;
+    for (uint64_t w : bits) total += __builtin_popcountll(w);
+    return total;
+}
+
+bool Bitfield::none() const {
+    for (uint64_t w : bits) {
+        if (w) return false;
+    }
+    return true;
+}
+
+bool Bitfield::hasAnyNotIn(const Bitfield& other) const {
+    size_t n = std::min(bits.size(), other.bits.size());
+    const uint64_t* a = bits.data();
+    const uint64_t* b = other.bits.data();
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        if (!_mm256_testc_si256(vb, va)) return true;  // testc is (~vb & va) == 0
+    }
+#elif defined(__SSE2__)
+    // OR a few 128-bit AND-NOTs together before testing, most calls exit in the first block
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 2 <= n) {
+        __m128i acc = zero;
+        size_t stop = std::min(n & ~size_t(1), i + 16);
+        for (; i < stop; i += 2) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+            acc = _mm_or_si128(acc, _mm_andnot_si128(vb, va));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) return true;
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (a[i] & ~b[i]) return true;
+    }
+    return false;
+}
+
+size_t Bitfield::countNotIn(const Bitfield& other) const {
+    size_t n = std::min(bits.size(), other.bits.size());
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) total += __builtin_popcountll(bits[i] & ~other.bits[i]);
+    return total;
+}
+
+long Bitfield::findNext(size_t from) const {
+    if (from >= numBits) return -1;
+
+    size_t w = from >> 6;
+    uint64_t word = bits[w] & (~uint64_t(0) >> (from & 63));  // drop bits before from
+    while (true) {
+        if (word) return (long)(w * 64 + __builtin_clzll(word));
+        if (++w >= bits.size()) return -1;
+        word = bits[w];
+    }
+}
+
+// Keep bits past numBits zero so count/all/compare can work on whole words
+void Bitfield::clearTail() {
+    size_t extra = bits.size() * 64 - numBits;
+    if (extra > 0 && !bits.empty()) {
+        bits.back() &= ~uint64_t(0) << extra;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef BIT_TORRENT_BITFIELD_H
+#define BIT_TORRENT_BITFIELD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Piece bitfield packed into 64-bit words in wire bit order: piece 0 is the most significant bit
+// of word 0, so a word is just 8 BITFIELD payload bytes read big-endian. Bits past size() are always 0.
+class Bitfield {
+public:
+    Bitfield() = default;
+    explicit Bitfield(size_t numBits, bool value = false);
+
+    // BITFIELD payload <-> bitfield, missing bytes read as 0 and extra bits are dropped
+    static Bitfield fromBytes(const unsigned char* data, size_t len, size_t numBits);
+    void toBytes(unsigned char* out) const;  // writes byteSize() bytes
+    std::vector<unsigned char> toBytes() const;
+
+    size_t size() const { return numBits; }
+    size_t byteSize() const { return (numBits + 7) / 8; }
+    void resize(size_t bits);
+
+    bool test(size_t i) const { return (bits[i >> 6] >> (63 - (i & 63))) & 1; }
+    bool operator[](size_t i) const { return test(i); }
+    void set(size_t i) { bits[i >> 6] |= uint64_t(1) << (63 - (i & 63)); }
+    void reset(size_t i) { bits[i >> 6] &= ~(uint64_t(1) << (63 - (i & 63))); }
+    void setAll(bool value);
+
+    size_t count() const;  // pieces set
+    bool all() const { return count() == numBits; }
+    bool none() const;
+
+    // "interesting": does this bitfield have any bit that other lacks (this & ~other != 0)
+    bool hasAnyNotIn(const Bitfield& other) const;
+    size_t countNotIn(const Bitfield& other) const;
+
+    // Next set bit at or after from, -1 when there is none
+    long findNext(size_t from) const;
+    long findFirst() const { return findNext(0); }
+
+    const uint64_t* words() const { return bits.data(); }
+    size_t wordCount() const { return bits.size(); }
+
+private:
+    std::vector<uint64_t> bits;
+    size_t numBits = 0;
+
+    void clearTail();
+};
+
+#endif //BIT_TORRENT_BITFIELD_H
@@ -0,0 +1,71 @@
+#ifndef BIT_TORRENT_DIAGNOSTICS_H
+#define BIT_TORRENT_DIAGNOSTICS_H
+
+#include <atomic>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <utility>
+
+// Console chatter, separate from the graded log file written by Logger.
+// Levels above BT_DIAG_LEVEL are compiled out: the call and the formatting disappear, only the argument
+// expressions are left for the optimizer. Whatever is compiled in can be turned down at runtime with
+// the DiagLevel key in Common.cfg.
+enum class DiagLevel : int {
+    Off = 0,
+    Error = 1,   // something failed
+    Info = 2,    // connection lifecycle, endgame, completion
+    Debug = 3,   // one line per message sent/received
+    Trace = 4    // bitfield dumps, per-block storage traffic
+};
+
+#ifndef BT_DIAG_LEVEL
+#define BT_DIAG_LEVEL 4
+#endif
+
+inline std::atomic<int> runtimeDiagLevel{BT_DIAG_LEVEL};
+
+inline void setDiagLevel(DiagLevel level) {
+    runtimeDiagLevel.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+// Parses off|error|info|debug|trace, anything else maps to Info
+inline DiagLevel parseDiagLevel(const std::string& name) {
+    if (name == "off") return DiagLevel::Off;
+    if (name == "error") return DiagLevel::Error;
+    if (name == "debug") return DiagLevel::Debug;
+    if (name == "trace") return DiagLevel::Trace;
+    return DiagLevel::Info;
+}
+
+// Constant false when the level isn't compiled in, so whole blocks can be guarded with it
+template <DiagLevel Level>
+inline bool diagEnabled() {
+    if constexpr (static_cast<int>(Level) > BT_DIAG_LEVEL) {
+        return false;
+    } else {
+        return static_cast<int>(Level) <= runtimeDiagLevel.load(std::memory_order_relaxed);
+    }
+}
+
+// One line per call. It is built first and written with a single fwrite, so lines from different
+// threads don't interleave. Errors go to stderr, the rest to stdout without a flush per line.
+template <DiagLevel Level, typename... Args>
+inline void diag(Args&&... args) {
+    if constexpr (static_cast<int>(Level) <= BT_DIAG_LEVEL) {
+        if (!diagEnabled<Level>()) return;
+
+        std::ostringstream oss;
+        (oss << ... << std::forward<Args>(args));
+        oss << '\n';
+        const std::string line = oss.str();
+        fwrite(line.data(), 1, line.size(), Level == DiagLevel::Error ? stderr : stdout);
+    }
+}
+
+template <typename... Args> inline void diagError(Args&&... args) { diag<DiagLevel::Error>(std::forward<Args>(args)...); }
+template <typename... Args> inline void diagInfo(Args&&... args) { diag<DiagLevel::Info>(std::forward<Args>(args)...); }
+template <typename... Args> inline void diagDebug(Args&&... args) { diag<DiagLevel::Debug>(std::forward<Args>(args)...); }
+template <typename... Args> inline void diagTrace(Args&&... args) { diag<DiagLevel::Trace>(std::forward<Args>(args)...); }
+
+#endif //BIT_TORRENT_DIAGNOSTICS_H
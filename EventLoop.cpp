@@ -0,0 +1,127 @@
+#include "EventLoop.h"
+#include <iostream>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+constexpr int MAX_EVENTS = 64;
+
+bool EventLoop::open() {
+    if (epollFd >= 0) return true;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        perror("epoll_create1");
+        return false;
+    }
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0) {
+        perror("eventfd");
+        return false;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+    // steady_clock is CLOCK_MONOTONIC, so its time points work as absolute timerfd deadlines
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0) {
+        perror("timerfd_create");
+        return false;
+    }
+    ev.data.fd = timerFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+    return true;
+}
+
+EventLoop::~EventLoop() {
+    if (timerFd >= 0) close(timerFd);
+    if (wakeFd >= 0) close(wakeFd);
+    if (epollFd >= 0) close(epollFd);
+}
+
+bool EventLoop::add(int fd, uint32_t events, Callback cb) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl add");
+        return false;
+    }
+    callbacks[fd] = std::move(cb);
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove(int fd) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    callbacks.erase(fd);
+}
+
+int EventLoop::poll(int timeoutMs) {
+    epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int dispatched = 0;
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == wakeFd) {
+            uint64_t drained;
+            while (read(wakeFd, &drained, sizeof(drained)) > 0) {}
+            continue;
+        }
+        if (fd == timerFd) {
+            uint64_t expirations;
+            while (read(timerFd, &expirations, sizeof(expirations)) > 0) {}
+            timerAt = std::chrono::steady_clock::time_point::max();
+            if (onTimer) onTimer();
+            dispatched++;
+            continue;
+        }
+
+        // an earlier callback in this batch may have removed the fd
+        auto it = callbacks.find(fd);
+        if (it == callbacks.end()) continue;
+
+        // copy so the callback may safely remove itself
+        Callback cb = it->second;
+        cb(events[i].events);
+        dispatched++;
+    }
+    return dispatched;
+}
+
+void EventLoop::setTimer(std::chrono::steady_clock::time_point when) {
+    if (timerFd < 0 || when == timerAt) return;
+    timerAt = when;
+
+    itimerspec spec{};  // all zero disarms
+    if (when != std::chrono::steady_clock::time_point::max()) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+        if (ns <= 0) ns = 1;  // zero would disarm, anything already past fires right away
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+    }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void EventLoop::wakeup() {
+    if (wakeFd < 0) return;
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+    (void)ignored;
+}
@@ -0,0 +1,48 @@
+#ifndef BIT_TORRENT_EVENTLOOP_H
+#define BIT_TORRENT_EVENTLOOP_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+// Thin epoll wrapper used by the reactor IO mode.
+// Only wakeup() may be called from another thread, everything else belongs to the loop thread.
+class EventLoop {
+public:
+    using Callback = std::function<void(uint32_t events)>;
+
+    EventLoop() = default;
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Create the epoll, wakeup and timer fds, done by the reactor so peers that never run one don't hold them
+    bool open();
+
+    // Register fd for the given epoll events (EPOLLIN, EPOLLOUT, ...)
+    bool add(int fd, uint32_t events, Callback cb);
+    bool modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    // Wait up to timeoutMs and dispatch ready callbacks. Returns number of events dispatched, -1 on error
+    int poll(int timeoutMs);
+
+    // Interrupt a poll() that is currently blocked
+    void wakeup();
+
+    // One deadline on the steady clock (a timerfd, nanosecond resolution), onTimer runs from poll()
+    // once it passes. A later call replaces it, time_point::max() disarms
+    void setTimer(std::chrono::steady_clock::time_point when);
+    std::function<void()> onTimer;
+
+private:
+    int epollFd = -1;
+    int wakeFd = -1;
+    int timerFd = -1;
+    std::chrono::steady_clock::time_point timerAt = std::chrono::steady_clock::time_point::max();
+    std::unordered_map<int, Callback> callbacks;
+};
+
+#endif //BIT_TORRENT_EVENTLOOP_H
@@ -0,0 +1,183 @@
+#include "FrameReader.h"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+std::vector<unsigned char> encodeFrame(unsigned char type, const unsigned char* payload, size_t len) {
+    std::vector<unsigned char> frame(5 + len);
+    uint32_t lenNet = htonl(1 + len);
+    memcpy(frame.data(), &lenNet, 4);
+    frame[4] = type;
+    if (len > 0) memcpy(frame.data() + 5, payload, len);
+    return frame;
+}
+
+// the buffer is allocated by the first fill or append
+FrameReader::FrameReader(size_t maxFrame) : maxFrame(maxFrame) {}
+
+void FrameReader::setBodySink(unsigned char type, size_t headerLen, BodySink bodySink) {
+    sink = std::move(bodySink);
+    sinkType = type;
+    sinkHeaderLen = headerLen;
+}
+
+ssize_t FrameReader::fill(int sock) {
+    // the rest of a diverted body, exactly that much so nothing after it has to be moved
+    if (directDest) {
+        ssize_t r;
+        do {
+            r = recv(sock, directDest + (directBody - directLeft), directLeft, 0);
+        } while (r < 0 && errno == EINTR);
+
+        if (r > 0) directLeft -= r;
+        lastFillFull = r > 0;
+        return r;
+    }
+
+    if (buf.empty()) buf.resize(READ_CHUNK);
+    makeRoom();
+
+    size_t room = buf.size() - tail;
+    ssize_t r;
+    do {
+        r = recv(sock, buf.data() + tail, room, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r > 0) tail += r;
+    lastFillFull = r > 0 && (size_t)r == room;
+    return r;
+}
+
+size_t FrameReader::append(const unsigned char* data, size_t len) {
+    if (directDest) {
+        size_t n = std::min(len, directLeft);
+        memcpy(directDest + (directBody - directLeft), data, n);
+        directLeft -= n;
+        return n;
+    }
+
+    // only as big as what is buffered, a connection that isn't mid-frame holds no memory
+    if (head == tail) {
+        head = tail = 0;
+    } else if (head > 0) {
+        memmove(buf.data(), buf.data() + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+    if (buf.size() - tail < len) buf.resize(tail + len);
+    memcpy(buf.data() + tail, data, len);
+    tail += len;
+    return len;
+}
+
+void FrameReader::trim() {
+    if (head != tail || directDest) return;
+    std::vector<unsigned char>().swap(buf);
+    head = tail = 0;
+}
+
+bool FrameReader::next(Message& msg) {
+    if (directDest) {
+        if (directLeft > 0) return false;
+        uint32_t lenNet;
+        memcpy(&lenNet, buf.data() + head, 4);
+        emitDiverted(msg, ntohl(lenNet));
+        return true;
+    }
+
+    while (buffered() >= 4) {
+        uint32_t lenNet;
+        memcpy(&lenNet, buf.data() + head, 4);
+        uint32_t length = ntohl(lenNet);
+
+        if (length == 0) {  // nothing but a length prefix, skip it
+            head += 4;
+            continue;
+        }
+        if (length > maxFrame) {
+            tooLong = true;
+            return false;
+        }
+        if (divert(length)) {
+            if (directLeft > 0) return false;
+            emitDiverted(msg, length);
+            return true;
+        }
+        if (buffered() - 4 < length) {
+            wanted = 4 + (size_t)length;  // let the next fill make room for all of it
+            return false;
+        }
+
+        msg.length = length;
+        msg.type = buf[head + 4];
+        msg.payload.ptr = buf.data() + head + 5;
+        msg.payload.len = length - 1;
+        msg.placedBytes = 0;
+        head += 4 + length;
+        wanted = 0;
+        sinkDeclined = false;
+        return true;
+    }
+    return false;
+}
+
+// Hand the body of the frame at head to the sink if it wants it. Only bytes of this frame can be
+// buffered behind its header when it isn't complete yet, so after copying them the buffer simply ends
+// at the header
+bool FrameReader::divert(uint32_t length) {
+    if (!sink || sinkDeclined || buffered() < 5 + sinkHeaderLen || buf[head + 4] != sinkType) return false;
+    if (length - 1 < sinkHeaderLen) return false;
+
+    size_t body = length - 1 - sinkHeaderLen;
+    unsigned char* dest = sink(buf.data() + head + 5, body);
+    if (!dest) {
+        sinkDeclined = true;
+        return false;
+    }
+
+    size_t bodyStart = head + 5 + sinkHeaderLen;
+    size_t have = std::min(body, tail - bodyStart);
+    memcpy(dest, buf.data() + bodyStart, have);
+
+    directDest = dest;
+    directBody = body;
+    directLeft = body - have;
+    if (directLeft > 0) tail = bodyStart;
+    return true;
+}
+
+// The diverted frame is complete: hand out its header, skip the body bytes that were buffered
+void FrameReader::emitDiverted(Message& msg, uint32_t length) {
+    size_t bodyStart = head + 5 + sinkHeaderLen;
+    size_t buffered = std::min(directBody, tail - bodyStart);
+
+    msg.length = length;
+    msg.type = buf[head + 4];
+    msg.payload.ptr = buf.data() + head + 5;
+    msg.payload.len = sinkHeaderLen;
+    msg.placedBytes = directBody;
+
+    head = bodyStart + buffered;
+    directDest = nullptr;
+    directLeft = 0;
+    directBody = 0;
+    wanted = 0;
+    sinkDeclined = false;
+}
+
+// Before a read: drop what's been parsed, slide the partial frame down if the space behind it is
+// getting short, and grow if one frame is bigger than the whole buffer
+void FrameReader::makeRoom() {
+    if (head == tail) {
+        head = tail = 0;
+    } else if (buf.size() - tail < READ_CHUNK / 4 || head + wanted > buf.size()) {
+        memmove(buf.data(), buf.data() + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+
+    size_t need = std::max(head + wanted, tail + READ_CHUNK / 4);
+    if (need > buf.size()) buf.resize(std::max(need, buf.size() * 2));
+}
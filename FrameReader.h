@@ -0,0 +1,100 @@
+#ifndef BIT_TORRENT_FRAMEREADER_H
+#define BIT_TORRENT_FRAMEREADER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <functional>
+#include <sys/types.h>
+
+// Bytes of a received payload, pointing into the connection's receive buffer rather than owning them
+struct PayloadView {
+    const unsigned char* ptr = nullptr;
+    size_t len = 0;
+
+    const unsigned char* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const unsigned char* begin() const { return ptr; }
+    const unsigned char* end() const { return ptr + len; }
+};
+
+struct Message {
+    uint32_t length;        // includes type byte + payload
+    unsigned char type;     // message ID
+    PayloadView payload;    // only valid until the connection reads again
+    size_t placedBytes = 0; // body bytes the reader already wrote to the sink's destination, not in payload
+};
+
+// The wire form of a message: 4 byte big-endian length (type + payload), type, payload
+std::vector<unsigned char> encodeFrame(unsigned char type, const unsigned char* payload, size_t len);
+
+// Per-connection receive buffer. Each fill() is one recv of as much as fits, then next() hands out
+// every complete frame sitting in the buffer, so a burst of small messages costs one syscall.
+// Consumed bytes are reclaimed by sliding the partial tail to the front before the next read,
+// which keeps every frame contiguous for the views.
+//
+// Frames of one type can have their body diverted: once the first headerLen payload bytes are buffered
+// the sink is asked where the body goes. Whatever of it is already buffered is copied there, the rest is
+// received straight into place, and the frame comes out of next() with just the header in payload
+class FrameReader {
+public:
+    static constexpr size_t READ_CHUNK = 64 * 1024;
+
+    // (header, bodyLength) -> destination for the body, or nullptr to leave it in the buffer
+    using BodySink = std::function<unsigned char*(const unsigned char* header, size_t bodyLength)>;
+
+    explicit FrameReader(size_t maxFrame = 16 * 1024 * 1024);
+
+    // One recv into the free space. >0 bytes read, 0 the peer closed, -1 error with errno set
+    // (EAGAIN when a non-blocking socket has nothing)
+    ssize_t fill(int sock);
+
+    // The same for bytes that didn't come from a socket. Takes up to len bytes and returns how many,
+    // less than len only when a diverted body ends inside them: call next() and append the rest
+    size_t append(const unsigned char* data, size_t len);
+
+    // Free the buffer while nothing is waiting in it, for connections that are idle most of the time
+    void trim();
+
+    // True if the last fill() got everything it asked for, so more is probably waiting
+    bool lastFillWasFull() const { return lastFillFull; }
+
+    // Next complete frame, skipping keep-alives. Views stay valid until the next fill().
+    // False when only part of a frame is buffered, or the frame is longer than maxFrame (see failed())
+    bool next(Message& msg);
+    bool failed() const { return tooLong; }
+
+    // Raw access for the handshake, which isn't length prefixed
+    size_t buffered() const { return tail - head; }
+    const unsigned char* peek() const { return buf.data() + head; }
+    void consume(size_t n) { head += n; }
+
+    void setMaxFrame(size_t n) { maxFrame = n; }
+    void setBodySink(unsigned char type, size_t headerLen, BodySink sink);
+
+private:
+    std::vector<unsigned char> buf;
+    size_t head = 0;   // first unparsed byte
+    size_t tail = 0;   // end of received data
+    size_t wanted = 0; // size of the frame next() is waiting on, 0 if unknown
+    size_t maxFrame;
+    bool tooLong = false;
+    bool lastFillFull = false;
+
+    BodySink sink;
+    unsigned char sinkType = 0;
+    size_t sinkHeaderLen = 0;
+    bool sinkDeclined = false;     // the sink already said no to the frame at head
+
+    // A diverted body still arriving. The frame's length, type and header stay at head in the buffer
+    unsigned char* directDest = nullptr;
+    size_t directLeft = 0;
+    size_t directBody = 0;
+
+    void makeRoom();
+    bool divert(uint32_t length);
+    void emitDiverted(Message& msg, uint32_t length);
+};
+
+#endif //BIT_TORRENT_FRAMEREADER_H
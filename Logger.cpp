@@ -12,6 +12,10 @@ Logger::Logger(Peer& owner) : owner_peer_(owner) {
     int peerID_val = owner_peer_.getPeerId();
     this->peerID = peerID_val;
     logFileName = "log_peer_" + std::to_string(peerID) + ".log";
+}
+
+void Logger::open() {
+    enabled = true;
     logFile.open(logFileName, std::ios::out | std::ios::app);
 
     if (!logFile.is_open()) {
@@ -23,20 +27,25 @@ Logger::Logger(Peer& owner) : owner_peer_(owner) {
 
 // Destructor
 Logger::~Logger() {
+    // let the writer drain whatever is still queued
+    if (writer.joinable()) {
+        stopping = true;
+        wakeCv.notify_one();
+        writer.join();
+    }
     if (logFile.is_open()) {
         logFile.close();
     }
 }
 
-// Get current timestamp in format: MM/DD/YYYY HH:MM:SS AM/PM
-std::string Logger::getCurrentTimestamp() {
-    time_t now = time(0);
+// Format a time as MM/DD/YYYY HH:MM:SS AM/PM
+std::string formatTimestamp(time_t when) {
     struct tm timeinfo;
 
 #ifdef _WIN32
-    localtime_s(&timeinfo, &now);
+    localtime_s(&timeinfo, &when);
 #else
-    localtime_r(&now, &timeinfo);
+    localtime_r(&when, &timeinfo);
 #endif
 
     std::ostringstream oss;
@@ -60,6 +69,20 @@ std::string Logger::getCurrentTimestamp() {
     return oss.str();
 }
 
+// Get current timestamp in format: MM/DD/YYYY HH:MM:SS AM/PM
+std::string Logger::getCurrentTimestamp() {
+    return formatTimestamp(time(0));
+}
+
+// The timestamp only changes once a second, so format it once per second
+const std::string& Logger::cachedTimestampFor(time_t when) {
+    if (when != cachedSecond) {
+        cachedSecond = when;
+        cachedTimestamp = formatTimestamp(when);
+    }
+    return cachedTimestamp;
+}
+
 // Thread-safe write to log file
 void Logger::writeLog(const std::string& message) {
     std::lock_guard<std::mutex> lock(logMutex);
@@ -69,101 +92,268 @@ void Logger::writeLog(const std::string& message) {
     }
 }
 
+void Logger::startAsync(size_t ringCapacity) {
+    if (async) return;
+
+    size_t capacity = 1;
+    while (capacity < ringCapacity) capacity <<= 1;
+
+    ring = std::vector<Slot>(capacity);
+    for (size_t i = 0; i < capacity; ++i) {
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    ringMask = capacity - 1;
+
+    async = true;
+    writer = std::thread(&Logger::writerLoop, this);
+}
+
+void Logger::submit(LogRecord& record) {
+    if (!enabled) return;
+    record.when = time(0);
+
+    if (!async) {
+        std::string line;
+        {
+            std::lock_guard<std::mutex> lock(logMutex);
+            formatRecord(record, line);
+        }
+        writeLog(line);
+        return;
+    }
+
+    // never drop a line: if the ring is full wait for the writer to catch up
+    while (!tryEnqueue(record)) {
+        wakeCv.notify_one();
+        std::this_thread::yield();
+    }
+    if (writerSleeping.load(std::memory_order_acquire)) {
+        wakeCv.notify_one();
+    }
+}
+
+// A slot is free for the producer claiming position pos when its sequence equals pos,
+// and holds a record for the consumer once the producer publishes pos + 1
+bool Logger::tryEnqueue(LogRecord& record) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+        Slot& slot = ring[pos & ringMask];
+        size_t seq = slot.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.record = std::move(record);
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;  // full
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool Logger::tryDequeue(LogRecord& record) {
+    Slot& slot = ring[dequeuePos & ringMask];
+    size_t seq = slot.sequence.load(std::memory_order_acquire);
+    if (seq != dequeuePos + 1) return false;  // empty, or the producer hasn't published yet
+
+    record = std::move(slot.record);
+    slot.sequence.store(dequeuePos + ringMask + 1, std::memory_order_release);
+    dequeuePos++;
+    return true;
+}
+
+// Drain everything queued, format it into one buffer and write it with a single flush
+void Logger::writerLoop() {
+    std::string batch;
+    LogRecord record;
+
+    while (true) {
+        batch.clear();
+        while (tryDequeue(record)) {
+            formatRecord(record, batch);
+            batch += '\n';
+        }
+
+        if (!batch.empty()) {
+            std::lock_guard<std::mutex> lock(logMutex);
+            if (logFile.is_open()) {
+                logFile.write(batch.data(), batch.size());
+                logFile.flush();
+            }
+            continue;
+        }
+
+        if (stopping) break;
+
+        std::unique_lock<std::mutex> lk(wakeMutex);
+        writerSleeping.store(true, std::memory_order_release);
+        wakeCv.wait_for(lk, std::chrono::milliseconds(10));
+        writerSleeping.store(false, std::memory_order_release);
+    }
+}
+
+// One log line without the trailing newline, appended to out
+void Logger::formatRecord(const LogRecord& record, std::string& out) {
+    out += '[';
+    out += cachedTimestampFor(record.when);
+    out += "]: Peer ";
+    out += std::to_string(peerID);
+
+    switch (record.event) {
+        case LogEvent::TCPConnectionMade:
+            out += " makes a connection to Peer " + std::to_string(record.peerID2) + ".";
+            break;
+        case LogEvent::TCPConnectionReceived:
+            out += " is connected from Peer " + std::to_string(record.peerID2) + ".";
+            break;
+        case LogEvent::PreferredNeighborsChange:
+            out += " has the preferred neighbors ";
+            if (!record.overflowText.empty()) {
+                out += record.overflowText;
+            } else {
+                for (int i = 0; i < record.neighborCount; ++i) {
+                    out += std::to_string(record.neighbors[i]);
+                    if (i < record.neighborCount - 1) {
+                        out += ",";
+                    }
+                }
+            }
+            out += ".";
+            break;
+        case LogEvent::OptimisticallyUnchokedNeighbor:
+            out += " has the optimistically unchoked neighbor " + std::to_string(record.peerID2) + ".";
+            break;
+        case LogEvent::Unchoking:
+            out += " is unchoked by " + std::to_string(record.peerID2) + ".";
+            break;
+        case LogEvent::Choking:
+            out += " is choked by " + std::to_string(record.peerID2) + ".";
+            break;
+        case LogEvent::ReceivingHave:
+            out += " received the 'have' message from " + std::to_string(record.peerID2)
+                 + " for the piece " + std::to_string(record.pieceIndex) + ".";
+            break;
+        case LogEvent::ReceivingInterested:
+            out += " received the 'interested' message from " + std::to_string(record.peerID2) + ".";
+            break;
+        case LogEvent::ReceivingNotInterested:
+            out += " received the 'not interested' message from " + std::to_string(record.peerID2) + ".";
+            break;
+        case LogEvent::DownloadingPiece:
+            out += " has downloaded the piece " + std::to_string(record.pieceIndex) + " from "
+                 + std::to_string(record.peerID2) + ". Now the number of pieces it has is "
+                 + std::to_string(record.numPieces) + ".";
+            break;
+        case LogEvent::DownloadComplete:
+            out += " has downloaded the complete file.";
+            break;
+    }
+}
+
 // 1. TCP connection made
 void Logger::logTCPConnectionMade(int peerID2) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " makes a connection to Peer " << peerID2 << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::TCPConnectionMade;
+    record.peerID2 = peerID2;
+    submit(record);
 }
 
 // 2. TCP connection received
 void Logger::logTCPConnectionReceived(int peerID2) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " is connected from Peer " << peerID2 << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::TCPConnectionReceived;
+    record.peerID2 = peerID2;
+    submit(record);
 }
 
 // 3. Change of preferred neighbors
 void Logger::logPreferredNeighborsChange(const std::vector<int>& preferredNeighbors) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " has the preferred neighbors ";
+    LogRecord record;
+    record.event = LogEvent::PreferredNeighborsChange;
 
-    for (size_t i = 0; i < preferredNeighbors.size(); ++i) {
-        oss << preferredNeighbors[i];
-        if (i < preferredNeighbors.size() - 1) {
-            oss << ",";
+    if ((int)preferredNeighbors.size() <= LogRecord::INLINE_NEIGHBORS) {
+        record.neighborCount = preferredNeighbors.size();
+        for (size_t i = 0; i < preferredNeighbors.size(); ++i) {
+            record.neighbors[i] = preferredNeighbors[i];
+        }
+    } else {
+        for (size_t i = 0; i < preferredNeighbors.size(); ++i) {
+            record.overflowText += std::to_string(preferredNeighbors[i]);
+            if (i < preferredNeighbors.size() - 1) {
+                record.overflowText += ",";
+            }
         }
     }
-    oss << ".";
 
-    writeLog(oss.str());
+    submit(record);
 }
 
 // 4. Change of optimistically unchoked neighbor
 void Logger::logOptimisticallyUnchokedNeighbor(int neighborID) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " has the optimistically unchoked neighbor " << neighborID << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::OptimisticallyUnchokedNeighbor;
+    record.peerID2 = neighborID;
+    submit(record);
 }
 
 // 5. Unchoking
 void Logger::logUnchoking(int peerID2) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " is unchoked by " << peerID2 << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::Unchoking;
+    record.peerID2 = peerID2;
+    submit(record);
 }
 
 // 6. Choking
 void Logger::logChoking(int peerID2) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " is choked by " << peerID2 << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::Choking;
+    record.peerID2 = peerID2;
+    submit(record);
 }
 
 // 7. Receiving 'have' message
 void Logger::logReceivingHave(int peerID2, int pieceIndex) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " received the 'have' message from " << peerID2
-        << " for the piece " << pieceIndex << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::ReceivingHave;
+    record.peerID2 = peerID2;
+    record.pieceIndex = pieceIndex;
+    submit(record);
 }
 
 // 8. Receiving 'interested' message
 void Logger::logReceivingInterested(int peerID2) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " received the 'interested' message from " << peerID2 << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::ReceivingInterested;
+    record.peerID2 = peerID2;
+    submit(record);
 }
 
 // 9. Receiving 'not interested' message
 void Logger::logReceivingNotInterested(int peerID2) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " received the 'not interested' message from " << peerID2 << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::ReceivingNotInterested;
+    record.peerID2 = peerID2;
+    submit(record);
 }
 
 // 10. Downloading a piece
 void Logger::logDownloadingPiece(int peerID2, int pieceIndex, int numPieces) {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " has downloaded the piece " << pieceIndex << " from " << peerID2
-        << ". Now the number of pieces it has is " << numPieces << ".";
-    writeLog(oss.str());
+    LogRecord record;
+    record.event = LogEvent::DownloadingPiece;
+    record.peerID2 = peerID2;
+    record.pieceIndex = pieceIndex;
+    record.numPieces = numPieces;
+    submit(record);
 }
 
 // 11. Completion of download
 void Logger::logDownloadComplete() {
-    std::ostringstream oss;
-    oss << "[" << getCurrentTimestamp() << "]: Peer " << peerID
-        << " has downloaded the complete file.";
-    writeLog(oss.str());
-}
\ No newline at end of file
+    LogRecord record;
+    record.event = LogEvent::DownloadComplete;
+    submit(record);
+}
@@ -8,31 +8,104 @@
 #include <fstream>
 #include <mutex>
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <ctime>
 
 class Peer;
 
+// Which of the 11 log lines a record is
+enum class LogEvent : unsigned char {
+    TCPConnectionMade,
+    TCPConnectionReceived,
+    PreferredNeighborsChange,
+    OptimisticallyUnchokedNeighbor,
+    Unchoking,
+    Choking,
+    ReceivingHave,
+    ReceivingInterested,
+    ReceivingNotInterested,
+    DownloadingPiece,
+    DownloadComplete
+};
+
+// Everything needed to format one line later. Preferred neighbor lists that don't fit inline
+// are formatted up front into overflowText
+struct LogRecord {
+    static constexpr int INLINE_NEIGHBORS = 16;
+
+    LogEvent event = LogEvent::DownloadComplete;
+    time_t when = 0;
+    int peerID2 = 0;
+    int pieceIndex = 0;
+    int numPieces = 0;
+    int neighborCount = 0;
+    int neighbors[INLINE_NEIGHBORS];
+    std::string overflowText;
+};
+
+// Format a time as MM/DD/YYYY HH:MM:SS AM/PM
+std::string formatTimestamp(time_t when);
+
 class Logger {
 private:
     std::string logFileName;
     std::ofstream logFile;
+    bool enabled = false;  // open() was called, LogMode off never does
     std::mutex logMutex;
     int peerID;
     Peer& owner_peer_;
 
+    // Async mode: bounded lock-free multi-producer/single-consumer ring (Vyukov style sequence numbers)
+    struct Slot {
+        std::atomic<size_t> sequence{0};
+        LogRecord record;
+    };
+    std::vector<Slot> ring;
+    size_t ringMask = 0;
+    std::atomic<size_t> enqueuePos{0};
+    size_t dequeuePos = 0;                  // writer thread only
+    std::atomic<bool> async{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> writerSleeping{false};
+    std::mutex wakeMutex;
+    std::condition_variable wakeCv;
+    std::thread writer;
+
+    // Last formatted second, only touched under logMutex or by the writer thread
+    time_t cachedSecond = -1;
+    std::string cachedTimestamp;
+
     // Helper method to get current timestamp in format: MM/DD/YYYY HH:MM:SS AM/PM
     std::string getCurrentTimestamp();
+    const std::string& cachedTimestampFor(time_t when);
 
     // Thread-safe write to log file
     void writeLog(const std::string& message);
 
+    // Hand a record to the writer thread, or format and write it right away in sync mode
+    void submit(LogRecord& record);
+    bool tryEnqueue(LogRecord& record);
+    bool tryDequeue(LogRecord& record);
+    void formatRecord(const LogRecord& record, std::string& out);
+    void writerLoop();
+
 public:
-    // Constructor: Opens log file for the given peer ID
+    // Constructor: nothing is written until open()
     Logger(Peer& owner);
 
+    // Opens the log file for the peer ID
+    void open();
+
 
     // Destructor: Closes log file
     ~Logger();
 
+    // Switch to async mode: calls only enqueue, a background thread formats and writes in batches.
+    // ringCapacity is rounded up to a power of two
+    void startAsync(size_t ringCapacity = 8192);
+
     // 1. TCP connection made
     void logTCPConnectionMade(int peerID2);
 
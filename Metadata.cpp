@@ -0,0 +1,79 @@
+#include "Metadata.h"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+bool Metadata::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open metadata file " << path << std::endl;
+        return false;
+    }
+
+    int pieces = -1;
+    std::string key;
+    while (pieces < 0 && file >> key) {
+        if (key == "FileName") file >> fileName;
+        else if (key == "FileSize") file >> fileSize;
+        else if (key == "PieceSize") file >> pieceSize;
+        else if (key == "Pieces") file >> pieces;
+        else {
+            std::string ignored;
+            file >> ignored;
+        }
+    }
+    if (pieces < 0 || pieceSize <= 0) {
+        std::cerr << "Error: " << path << " is missing its header" << std::endl;
+        return false;
+    }
+
+    pieceHashes.resize(pieces);
+    std::string hex;
+    for (int i = 0; i < pieces; ++i) {
+        if (!(file >> hex) || !Sha256::fromHex(hex, pieceHashes[i])) {
+            std::cerr << "Error: bad digest for piece " << i << " in " << path << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Metadata::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not write metadata file " << path << std::endl;
+        return false;
+    }
+
+    file << "FileName " << fileName << "\n"
+         << "FileSize " << fileSize << "\n"
+         << "PieceSize " << pieceSize << "\n"
+         << "Pieces " << pieceHashes.size() << "\n";
+    for (const Sha256::Digest& digest : pieceHashes) {
+        file << Sha256::toHex(digest) << "\n";
+    }
+    return (bool)file;
+}
+
+bool Metadata::build(const std::string& path, long size, int pieceLength) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Cannot open " << path << std::endl;
+        return false;
+    }
+
+    fileSize = size;
+    pieceSize = pieceLength;
+    long numPieces = (size + pieceLength - 1) / pieceLength;
+    pieceHashes.assign(numPieces, {});
+
+    std::vector<unsigned char> piece(pieceLength);
+    for (long i = 0; i < numPieces; ++i) {
+        size_t len = std::min<long>(pieceLength, size - i * pieceLength);
+        std::fill(piece.begin(), piece.end(), 0);
+        file.read((char*)piece.data(), len);
+        file.clear();  // a short read at EOF just leaves the zeros
+        pieceHashes[i] = Sha256::hash(piece.data(), len);
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef BIT_TORRENT_METADATA_H
+#define BIT_TORRENT_METADATA_H
+
+#include <string>
+#include <vector>
+#include "Sha256.h"
+
+// Per-piece SHA-256 digests of the shared file, written by makeMetadata and read by every peer.
+// Text, in the same key/value style as Common.cfg, followed by one hex digest per piece:
+//   FileName thefile
+//   FileSize 10000232
+//   PieceSize 32768
+//   Pieces 306
+//   <64 hex chars>   (piece 0)
+//   ...
+class Metadata {
+public:
+    std::string fileName;
+    long fileSize = 0;
+    int pieceSize = 0;
+    std::vector<Sha256::Digest> pieceHashes;
+
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+
+    // Hash the file piece by piece, bytes past the end of a shorter file count as zeros
+    bool build(const std::string& path, long size, int pieceLength);
+};
+
+#endif //BIT_TORRENT_METADATA_H
@@ -0,0 +1,87 @@
+#include "PeerTable.h"
+#include <algorithm>
+
+void PeerTable::reset(const std::vector<int>& peerIDs, size_t pieces, double rateWindow) {
+    size_t n = peerIDs.size();
+    numPieces = pieces;
+    ids = peerIDs;
+    flags = std::vector<std::atomic<uint8_t>>(n);
+    for (auto& f : flags) f = INITIAL_FLAGS;
+    sockets.assign(n, -1);
+    bitfields.assign(n, Bitfield());
+    heardFrom.assign(n, 0);
+    missing.assign(n, 0);
+    heardFromCount = 0;
+    incomplete = 0;
+    downloaded.assign(n, RateMeter(rateWindow));
+    uploaded.assign(n, RateMeter(rateWindow));
+    inPicker.assign(n, 0);
+    pipelines.assign(n, RequestPipeline());
+
+    slotByOffset.clear();
+    slotByID.clear();
+    if (n == 0) return;
+
+    auto [lo, hi] = std::minmax_element(peerIDs.begin(), peerIDs.end());
+    long span = (long)*hi - *lo + 1;
+    if (span <= 16 * (long)n + 64) {
+        firstID = *lo;
+        slotByOffset.assign(span, -1);
+        for (size_t i = 0; i < n; i++) slotByOffset[peerIDs[i] - firstID] = i;
+    } else {
+        for (size_t i = 0; i < n; i++) slotByID[peerIDs[i]] = i;
+    }
+}
+
+int PeerTable::slotOf(int peerID) const {
+    if (!slotByOffset.empty()) {
+        long offset = (long)peerID - firstID;
+        return offset >= 0 && offset < (long)slotByOffset.size() ? slotByOffset[offset] : -1;
+    }
+    auto it = slotByID.find(peerID);
+    return it == slotByID.end() ? -1 : it->second;
+}
+
+void PeerTable::set(int slot, uint8_t flag, bool on) {
+    if (on) flags[slot].fetch_or(flag);
+    else flags[slot].fetch_and(~flag);
+}
+
+void PeerTable::resetConnectionState(int slot) {
+    // one atomic step, a reader on another thread never sees the choke bits cleared
+    uint8_t old = flags[slot].load();
+    while (!flags[slot].compare_exchange_weak(old, (uint8_t)((old & (BlockTransfer | MultiHave)) | INITIAL_FLAGS))) {
+    }
+    downloaded[slot].clear();
+    uploaded[slot].clear();
+}
+
+Bitfield PeerTable::replaceBitfield(int slot, Bitfield bits) {
+    if (!heardFrom[slot]) {
+        heardFrom[slot] = 1;
+        heardFromCount++;
+    } else if (missing[slot] > 0) {
+        incomplete--;
+    }
+
+    missing[slot] = numPieces - bits.count();
+    if (missing[slot] > 0) incomplete++;
+    std::swap(bitfields[slot], bits);
+    return bits;
+}
+
+bool PeerTable::addPiece(int slot, int pieceIndex) {
+    if (!heardFrom[slot]) {
+        heardFrom[slot] = 1;
+        heardFromCount++;
+        bitfields[slot] = Bitfield(numPieces);
+        missing[slot] = numPieces;
+        if (numPieces > 0) incomplete++;
+    }
+
+    Bitfield& bits = bitfields[slot];
+    if (bits[pieceIndex]) return false;
+    bits.set(pieceIndex);
+    if (--missing[slot] == 0) incomplete--;
+    return true;
+}
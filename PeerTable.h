@@ -0,0 +1,81 @@
+#ifndef BIT_TORRENT_PEERTABLE_H
+#define BIT_TORRENT_PEERTABLE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "Bitfield.h"
+#include "RateMeter.h"
+
+// REQUESTs in flight to one neighbor
+struct RequestPipeline {
+    std::map<std::pair<int, int>, std::chrono::steady_clock::time_point> outstanding; // (piece, offset) -> when we asked
+    double minRtt = 0.0;        // seconds, lowest request->piece turnaround seen
+    double deliveryRate = 0.0;  // bytes/sec, smoothed over piece arrivals
+    std::chrono::steady_clock::time_point lastDelivery;
+    bool snubbed = false;       // let a request time out, cleared by the next delivery
+};
+
+// Everything we keep per neighbor, one array per field indexed by slot. Every other peer in
+// PeerInfo.cfg gets a slot (in file order) when the table is built and keeps it across reconnects,
+// so the arrays never move once the peer runs and loops over neighbors walk them in order.
+//
+// Who may touch what:
+// - ids and slotOf() never change after reset(), any thread without a lock
+// - flags are atomic bytes, any thread
+// - sockets: socketMutex
+// - bitfields, heardFrom, missing, the counts and the rate meters: neighborMutex
+// - inPicker and pipelines: requestedPiecesMutex
+class PeerTable {
+public:
+    // Per slot flags, packed in one byte so choke rounds and broadcasts scan a single array
+    enum Flag : uint8_t {
+        PeerChoking = 1 << 0,     // the remote peer is choking us
+        PeerInterested = 1 << 1,  // the remote peer is interested in us
+        AmChoking = 1 << 2,       // we are choking them
+        AmInterested = 1 << 3,    // we are interested in them
+        BlockTransfer = 1 << 4,   // both sides advertised HS_BLOCK_TRANSFER
+        MultiHave = 1 << 5,       // they advertised HS_MULTI_HAVE
+    };
+    static constexpr uint8_t INITIAL_FLAGS = PeerChoking | AmChoking;
+
+    void reset(const std::vector<int>& peerIDs, size_t numPieces, double rateWindow);
+
+    int size() const { return (int)ids.size(); }
+    int slotOf(int peerID) const;  // -1 when the ID isn't one of our neighbors
+
+    bool has(int slot, uint8_t flag) const { return flags[slot] & flag; }
+    void set(int slot, uint8_t flag, bool on);
+    // A new connection starts choked and uninterested. The rates go too, the features stay until the next handshake
+    void resetConnectionState(int slot);
+
+    // Bitfield bookkeeping, neighborMutex. A neighbor's bitfield is allocated when we first hear from it
+    Bitfield replaceBitfield(int slot, Bitfield bits);  // returns the previous one
+    bool addPiece(int slot, int pieceIndex);            // false if they already had it
+    bool allComplete() const { return heardFromCount == size() && incomplete == 0; }
+
+    std::vector<int> ids;                       // slot -> peer ID
+    std::vector<std::atomic<uint8_t>> flags;    // Flag bits
+    std::vector<int> sockets;                   // -1 = not connected
+    std::vector<Bitfield> bitfields;            // their pieces, kept after they disconnect
+    std::vector<char> heardFrom;                // got a BITFIELD or HAVE, bitfields[slot] is real
+    std::vector<int> missing;                   // pieces bitfields[slot] lacks
+    int heardFromCount = 0;
+    int incomplete = 0;                         // slots heard from and still missing pieces
+    std::vector<RateMeter> downloaded;          // PIECE bytes they sent us
+    std::vector<RateMeter> uploaded;            // PIECE bytes we got onto the wire to them
+    std::vector<char> inPicker;                 // bitfields[slot] is counted in the availability index
+    std::vector<RequestPipeline> pipelines;
+
+private:
+    size_t numPieces = 0;
+    // IDs are usually a small contiguous range, then the lookup is one array index, otherwise a hash
+    int firstID = 0;
+    std::vector<int> slotByOffset;
+    std::unordered_map<int, int> slotByID;
+};
+
+#endif //BIT_TORRENT_PEERTABLE_H
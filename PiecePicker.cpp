@@ -0,0 +1,65 @@
+#include "PiecePicker.h"
+
+void PiecePicker::reset(int numPieces) {
+    counts.assign(numPieces, 0);
+    positions.resize(numPieces);
+    buckets.assign(1, {});
+    buckets[0].reserve(numPieces);
+    for (int i = 0; i < numPieces; ++i) {
+        positions[i] = i;
+        buckets[0].push_back(i);
+    }
+    numRemaining = numPieces;
+}
+
+void PiecePicker::addPeer(const Bitfield& peerBitfield) {
+    for (long i = peerBitfield.findFirst(); i >= 0 && i < (long)counts.size(); i = peerBitfield.findNext(i + 1)) {
+        increment(i);
+    }
+}
+
+void PiecePicker::removePeer(const Bitfield& peerBitfield) {
+    for (long i = peerBitfield.findFirst(); i >= 0 && i < (long)counts.size(); i = peerBitfield.findNext(i + 1)) {
+        decrement(i);
+    }
+}
+
+void PiecePicker::increment(int pieceIndex) {
+    if (pieceIndex < 0 || pieceIndex >= (int)counts.size()) return;
+    move(pieceIndex, counts[pieceIndex] + 1);
+}
+
+void PiecePicker::decrement(int pieceIndex) {
+    if (pieceIndex < 0 || pieceIndex >= (int)counts.size() || counts[pieceIndex] == 0) return;
+    move(pieceIndex, counts[pieceIndex] - 1);
+}
+
+void PiecePicker::markHave(int pieceIndex) {
+    if (pieceIndex < 0 || pieceIndex >= (int)counts.size() || positions[pieceIndex] < 0) return;
+    unlink(pieceIndex);
+    positions[pieceIndex] = -1;
+    numRemaining--;
+}
+
+// Counts are kept for pieces we have too, only bucket membership stops
+void PiecePicker::move(int pieceIndex, int newCount) {
+    bool tracked = positions[pieceIndex] >= 0;
+    if (tracked) unlink(pieceIndex);
+
+    counts[pieceIndex] = newCount;
+    if (!tracked) return;
+
+    if ((int)buckets.size() <= newCount) buckets.resize(newCount + 1);
+    positions[pieceIndex] = buckets[newCount].size();
+    buckets[newCount].push_back(pieceIndex);
+}
+
+// O(1) removal from its bucket: swap with the last entry
+void PiecePicker::unlink(int pieceIndex) {
+    std::vector<int>& bucket = buckets[counts[pieceIndex]];
+    int slot = positions[pieceIndex];
+    int last = bucket.back();
+    bucket[slot] = last;
+    positions[last] = slot;
+    bucket.pop_back();
+}
@@ -0,0 +1,59 @@
+#ifndef BIT_TORRENT_PIECEPICKER_H
+#define BIT_TORRENT_PIECEPICKER_H
+
+#include <vector>
+#include <random>
+#include "Bitfield.h"
+
+// Rarest-first selection over the pieces we still need.
+// Each piece sits in the bucket for its availability (how many neighbors have it), moving one
+// bucket up or down per HAVE/BITFIELD/disconnect in O(1). Picking walks buckets from the rarest
+// and stops at the first acceptable piece, so it doesn't rescan the whole file. Not thread safe.
+class PiecePicker {
+public:
+    explicit PiecePicker(int numPieces = 0) { reset(numPieces); }
+
+    void reset(int numPieces);
+
+    // A neighbor's whole bitfield arrived / went away
+    void addPeer(const Bitfield& peerBitfield);
+    void removePeer(const Bitfield& peerBitfield);
+
+    // One neighbor gained / lost a piece
+    void increment(int pieceIndex);
+    void decrement(int pieceIndex);
+
+    // We own the piece now, it's never picked again
+    void markHave(int pieceIndex);
+
+    int availability(int pieceIndex) const { return counts[pieceIndex]; }
+    int remaining() const { return numRemaining; }
+
+    // Rarest available piece accepted by accept(pieceIndex), ties broken at random from rng. -1 if none
+    template <typename Accept>
+    int pickRarest(Accept accept, std::mt19937& rng) const {
+        for (size_t count = 1; count < buckets.size(); ++count) {
+            const std::vector<int>& bucket = buckets[count];
+            if (bucket.empty()) continue;
+
+            // random starting point then wrap, so equally rare pieces are spread across requesters
+            size_t start = rng() % bucket.size();
+            for (size_t i = 0; i < bucket.size(); ++i) {
+                int pieceIndex = bucket[(start + i) % bucket.size()];
+                if (accept(pieceIndex)) return pieceIndex;
+            }
+        }
+        return -1;
+    }
+
+private:
+    std::vector<int> counts;               // piece -> neighbors that have it
+    std::vector<int> positions;            // piece -> slot in its bucket, -1 once we have it
+    std::vector<std::vector<int>> buckets; // availability -> pieces we still need
+    int numRemaining = 0;
+
+    void move(int pieceIndex, int newCount);
+    void unlink(int pieceIndex);
+};
+
+#endif //BIT_TORRENT_PIECEPICKER_H
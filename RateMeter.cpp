@@ -0,0 +1,21 @@
+#include "RateMeter.h"
+#include <cmath>
+
+namespace {
+
+double decayed(double value, RateMeter::Clock::time_point from, RateMeter::Clock::time_point to, double window) {
+    if (from.time_since_epoch().count() == 0 || to <= from) return value;
+    double dt = std::chrono::duration<double>(to - from).count();
+    return value * std::exp(-dt / window);
+}
+
+}
+
+void RateMeter::add(Clock::time_point now, size_t bytes) {
+    value = decayed(value, last, now, window) + bytes / window;
+    if (now > last) last = now;
+}
+
+double RateMeter::rate(Clock::time_point now) const {
+    return decayed(value, last, now, window);
+}
@@ -0,0 +1,27 @@
+#ifndef BIT_TORRENT_RATEMETER_H
+#define BIT_TORRENT_RATEMETER_H
+
+#include <chrono>
+#include <cstddef>
+
+// Transfer rate as an exponentially weighted moving average over time, not over samples. Every
+// byte adds 1/window to the estimate and the estimate decays by e^(-dt/window) as time passes, so
+// a steady flow of R bytes/sec converges to R and a stalled one fades out within a few windows.
+// Only ever sees monotonic timestamps, there's nothing to reset between rounds. Not thread safe.
+class RateMeter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RateMeter(double windowSeconds = 10.0) : window(windowSeconds) {}
+
+    void add(Clock::time_point now, size_t bytes);
+    double rate(Clock::time_point now) const;  // bytes/sec
+    void clear() { value = 0.0; last = Clock::time_point(); }
+
+private:
+    double window;
+    double value = 0.0;      // bytes/sec as of last
+    Clock::time_point last;  // zero = nothing counted yet
+};
+
+#endif //BIT_TORRENT_RATEMETER_H
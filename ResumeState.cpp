@@ -0,0 +1,71 @@
+#include "ResumeState.h"
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <sys/stat.h>
+
+bool ResumeState::load(const std::string& path, size_t numPieces) {
+    std::ifstream file(path);
+    if (!file.is_open()) return false;  // first run, nothing to resume
+
+    std::string key, hex;
+    while (file >> key) {
+        if (key == "FileSize") file >> fileSize;
+        else if (key == "PieceSize") file >> pieceSize;
+        else if (key == "FileMtime") file >> fileMtime;
+        else if (key == "Pieces") file >> hex;
+        else {
+            std::string ignored;
+            file >> ignored;
+        }
+    }
+
+    std::vector<unsigned char> bytes(hex.size() / 2);
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        try {
+            bytes[i] = (unsigned char)std::stoi(hex.substr(i * 2, 2), nullptr, 16);
+        } catch (...) {
+            std::cerr << "Error: bad Pieces line in " << path << std::endl;
+            return false;
+        }
+    }
+    if (bytes.size() != (numPieces + 7) / 8) {
+        std::cerr << "Error: " << path << " is for a different number of pieces" << std::endl;
+        return false;
+    }
+    pieces = Bitfield::fromBytes(bytes.data(), bytes.size(), numPieces);
+    return true;
+}
+
+bool ResumeState::save(const std::string& path) const {
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::out | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not write resume file " << tmpPath << std::endl;
+            return false;
+        }
+
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (unsigned char b : pieces.toBytes()) {
+            hex += digits[b >> 4];
+            hex += digits[b & 0xf];
+        }
+
+        file << "FileSize " << fileSize << "\n"
+             << "PieceSize " << pieceSize << "\n"
+             << "FileMtime " << fileMtime << "\n"
+             << "Pieces " << hex << "\n";
+        if (!file.flush()) return false;
+    }
+    return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+bool ResumeState::fileStatus(const std::string& path, long& size, long long& mtime) {
+    struct stat st{};
+    if (stat(path.c_str(), &st) < 0) return false;
+    size = st.st_size;
+    mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+}
@@ -0,0 +1,28 @@
+#ifndef BIT_TORRENT_RESUMESTATE_H
+#define BIT_TORRENT_RESUMESTATE_H
+
+#include <string>
+#include "Bitfield.h"
+
+// What a downloader had safely on disk the last time it checked in, so a restart doesn't refetch it.
+// Same key/value text as Metadata, the bitfield is its BITFIELD payload in hex:
+//   FileSize 10000232
+//   PieceSize 32768
+//   FileMtime 1760668800123456789   (ns, of the data file right after the save flushed it)
+//   Pieces ffffc0...
+class ResumeState {
+public:
+    long fileSize = 0;
+    int pieceSize = 0;
+    long long fileMtime = 0;
+    Bitfield pieces;
+
+    bool load(const std::string& path, size_t numPieces);
+    // Written next to path and renamed over it, a crash mid-save leaves the previous state
+    bool save(const std::string& path) const;
+
+    // Size and mtime (ns) of a file, false if it doesn't exist
+    static bool fileStatus(const std::string& path, long& size, long long& mtime);
+};
+
+#endif //BIT_TORRENT_RESUMESTATE_H
@@ -0,0 +1,34 @@
+#ifndef BIT_TORRENT_SHA256_H
+#define BIT_TORRENT_SHA256_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Plain FIPS 180-4 SHA-256, enough for piece digests without pulling in a crypto library
+class Sha256 {
+public:
+    using Digest = std::array<uint8_t, 32>;
+
+    Sha256() { reset(); }
+
+    void reset();
+    void update(const unsigned char* data, size_t len);
+    Digest finish();
+
+    static Digest hash(const unsigned char* data, size_t len);
+
+    static std::string toHex(const Digest& digest);
+    static bool fromHex(const std::string& hex, Digest& out);
+
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t blockLen = 0;
+    uint64_t totalLen = 0;
+
+    void compress(const unsigned char* chunk);
+};
+
+#endif //BIT_TORRENT_SHA256_H
@@ -0,0 +1,134 @@
+#include "SimNetwork.h"
+#include <algorithm>
+#include "peer.h"
+
+SimNetwork::SimNetwork(const Options& options) : options(options), rng(options.seed) {}
+
+int SimNetwork::nodeOf(int peerID) {
+    auto [it, added] = nodeByID.try_emplace(peerID, (int)nodes.size());
+    if (added) {
+        nodes.emplace_back();
+        nodes.back().peerID = peerID;
+        nodes.back().port = std::make_unique<Port>(*this, it->second);
+    }
+    return it->second;
+}
+
+Transport* SimNetwork::port(int peerID) {
+    return nodes[nodeOf(peerID)].port.get();
+}
+
+void SimNetwork::addPeer(int peerID, Peer* peer) {
+    nodes[nodeOf(peerID)].peer = peer;
+}
+
+void SimNetwork::connect(int fromID, int toID) {
+    std::uniform_real_distribution<double> draw(options.minLatency, std::max(options.minLatency, options.maxLatency));
+    auto latency = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(draw(rng)));
+
+    int nodeA = nodeOf(fromID);
+    int nodeB = nodeOf(toID);
+    Node& a = nodes[nodeA];
+    Node& b = nodes[nodeB];
+    int from = endpoints.size();
+    int to = from + 1;
+    endpoints.push_back({nodeA, (int)a.endpoints.size(), to, latency});
+    endpoints.push_back({nodeB, (int)b.endpoints.size(), from, latency});
+    a.endpoints.push_back(from);
+    b.endpoints.push_back(to);
+
+    b.peer->openTransportConnection(endpoints[to].handle, false);
+    a.peer->openTransportConnection(endpoints[from].handle, true);
+}
+
+void SimNetwork::disconnectPeer(int peerID) {
+    Node& node = nodes[nodeOf(peerID)];
+    for (int end : node.endpoints) {
+        if (endpoints[end].open) node.peer->closeTransportConnection(endpoints[end].handle);
+    }
+}
+
+SimNetwork::Pending& SimNetwork::enqueue(Clock::time_point when, Action action, int peerID) {
+    uint32_t slot;
+    if (freeSlots.empty()) {
+        slot = pool.size();
+        pool.emplace_back();
+    } else {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    events.push_back({std::max(when, current), nextSeq++, slot});
+    std::push_heap(events.begin(), events.end(), std::greater<>());
+
+    Pending& p = pool[slot];
+    p.action = action;
+    p.peerID = peerID;
+    return p;
+}
+
+void SimNetwork::schedule(Clock::time_point when, int peerID, std::function<void()> fn) {
+    enqueue(when, Action::Call, peerID).fn = std::move(fn);
+}
+
+void SimNetwork::run(Clock::time_point until, const std::function<bool()>& stop) {
+    while (!events.empty() && events.front().when <= until && !(stop && stop())) {
+        std::pop_heap(events.begin(), events.end(), std::greater<>());
+        Event event = events.back();
+        events.pop_back();
+        current = event.when;
+
+        // taken out of the slot first, whatever runs may queue more events and grow the pool
+        Pending& p = pool[event.slot];
+        Action action = p.action;
+        int peerID = p.peerID;
+        int endpoint = p.endpoint;
+        std::vector<unsigned char> bytes = std::move(p.bytes);
+        std::function<void()> fn = action == Action::Call ? std::move(p.fn) : nullptr;
+        freeSlots.push_back(event.slot);
+
+        if (action == Action::Call) {
+            fn();
+        } else if (endpoints[endpoint].open) {
+            const Endpoint& end = endpoints[endpoint];
+            Peer* peer = nodes[end.node].peer;
+            if (action == Action::Deliver) peer->receiveTransport(end.handle, bytes.data(), bytes.size());
+            else peer->closeTransportConnection(end.handle);
+        }
+        eventsRun++;
+        if (peerID >= 0 && afterEvent) afterEvent(peerID);
+    }
+}
+
+// The sender's upload link is a FIFO: bytes leave after everything it sent earlier, on any
+// connection, then take the connection's latency to arrive
+void SimNetwork::send(int node, int conn, std::vector<unsigned char> bytes) {
+    const Endpoint& from = endpoints[nodes[node].endpoints[conn]];
+    if (!from.open) return;
+
+    bytesSent += bytes.size();
+    if (bytes.size() > 4 && bytes[4] == 7) pieceBytesSent[nodes[node].peerID] += bytes.size();
+
+    Clock::time_point& busy = nodes[node].uploadBusyUntil;
+    Clock::time_point departs = std::max(current, busy);
+    if (options.uploadRate > 0) {
+        departs += std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(bytes.size() / options.uploadRate));
+    }
+    busy = departs;
+
+    int to = from.remote;
+    Pending& p = enqueue(departs + from.latency, Action::Deliver, nodes[endpoints[to].node].peerID);
+    p.endpoint = to;
+    p.bytes = std::move(bytes);
+}
+
+// The close reaches the other end after whatever was already sent on the connection
+void SimNetwork::close(int node, int conn) {
+    Endpoint& end = endpoints[nodes[node].endpoints[conn]];
+    if (!end.open) return;
+    end.open = false;
+
+    int remote = end.remote;
+    Clock::time_point departs = std::max(current, nodes[node].uploadBusyUntil);
+    enqueue(departs + end.latency, Action::Close, nodes[endpoints[remote].node].peerID).endpoint = remote;
+}
@@ -0,0 +1,126 @@
+#ifndef BIT_TORRENT_SIMNETWORK_H
+#define BIT_TORRENT_SIMNETWORK_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "Transport.h"
+
+class Peer;
+
+// In-memory network for running many Peers in one process on a virtual clock. A send becomes an
+// event that fires once the sender's upload link has pushed the bytes out and the connection's
+// latency has passed. Events run one at a time in (time, scheduling order), nothing depends on the
+// wall clock, so the same options and seed always give the same run
+class SimNetwork {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        double minLatency = 0.02;  // seconds one way, each connection draws its own from [min, max]
+        double maxLatency = 0.08;
+        double uploadRate = 1e6;   // bytes/sec per peer, shared by all its connections. 0 = unlimited
+        unsigned seed = 1;
+    };
+
+    explicit SimNetwork(const Options& options);
+
+    // The Transport to build peerID's Peer with. Each peer numbers its own connections 0, 1, 2...
+    // like socket fds, so it can keep them in plain arrays
+    Transport* port(int peerID);
+    void addPeer(int peerID, Peer* peer);
+    // Both ends are open right away, the initiator's handshake is the first thing on the wire
+    void connect(int fromID, int toID);
+    // Close all of a peer's connections, as if its process exited
+    void disconnectPeer(int peerID);
+
+    // fn runs at when. peerID >= 0 says whose event it is, afterEvent gets it once fn returns
+    void schedule(Clock::time_point when, int peerID, std::function<void()> fn);
+    // Run events until the queue is empty, the next one is past until, or stop() says so
+    void run(Clock::time_point until, const std::function<bool()>& stop);
+    std::function<void(int peerID)> afterEvent;
+
+    // Virtual time zero. Not the clock's epoch, a zero time_point means "never" to the peers
+    Clock::time_point start() const { return startTime; }
+    Clock::time_point now() const { return current; }
+    double seconds() const { return std::chrono::duration<double>(current - startTime).count(); }
+
+    // Totals so far
+    uint64_t eventsRun = 0;
+    uint64_t bytesSent = 0;
+    std::unordered_map<int, uint64_t> pieceBytesSent;  // peer ID -> bytes of PIECE frames it uploaded
+
+private:
+    class Port : public Transport {
+    public:
+        Port(SimNetwork& net, int node) : net(net), node(node) {}
+        Clock::time_point now() override { return net.current; }
+        void send(int conn, std::vector<unsigned char> bytes) override { net.send(node, conn, std::move(bytes)); }
+        void close(int conn) override { net.close(node, conn); }
+
+    private:
+        SimNetwork& net;
+        int node;
+    };
+
+    struct Node {
+        int peerID;
+        Peer* peer = nullptr;
+        std::unique_ptr<Port> port;
+        Clock::time_point uploadBusyUntil;  // when its upload link is free
+        std::vector<int> endpoints;         // the peer's connection handle -> its end
+    };
+
+    struct Endpoint {
+        int node;
+        int handle;  // what the node's peer calls this connection
+        int remote;  // the other end
+        Clock::duration latency;
+        bool open = true;
+    };
+
+    // What an event does. Deliveries and closes are nearly every event of a run and need no
+    // std::function, the bytes ride in the pool slot
+    enum class Action : uint8_t { Deliver, Close, Call };
+
+    struct Pending {
+        Action action = Action::Call;
+        int peerID = -1;  // whose event, for afterEvent
+        int endpoint = 0; // Deliver and Close: the receiving end
+        std::vector<unsigned char> bytes;
+        std::function<void()> fn;
+    };
+
+    // Heap entries only point at their pool slot, so sifting moves a few words
+    struct Event {
+        Clock::time_point when;
+        uint64_t seq;
+        uint32_t slot;
+
+        bool operator>(const Event& other) const {
+            return when != other.when ? when > other.when : seq > other.seq;
+        }
+    };
+
+    Options options;
+    std::mt19937 rng;
+    const Clock::time_point startTime = Clock::time_point(std::chrono::hours(1));
+    Clock::time_point current = startTime;
+    uint64_t nextSeq = 0;
+    std::vector<Event> events;                 // min-heap on (when, seq)
+    std::vector<Pending> pool;                 // event slots, reused through freeSlots
+    std::vector<uint32_t> freeSlots;
+    std::vector<Node> nodes;
+    std::vector<Endpoint> endpoints;
+    std::unordered_map<int, int> nodeByID;     // peer ID -> node, only for setup
+
+    int nodeOf(int peerID);
+    Pending& enqueue(Clock::time_point when, Action action, int peerID);
+    void send(int node, int conn, std::vector<unsigned char> bytes);
+    void close(int node, int conn);
+};
+
+#endif //BIT_TORRENT_SIMNETWORK_H
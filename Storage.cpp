@@ -0,0 +1,123 @@
+#include "Storage.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+Storage::~Storage() {
+    close();
+}
+
+bool Storage::open(const std::string& path, long fileSize, bool openReadOnly) {
+    close();
+    size = fileSize;
+    readOnly = openReadOnly;
+
+    fd = ::open(path.c_str(), readOnly ? (O_RDONLY | O_CLOEXEC) : (O_RDWR | O_CREAT | O_CLOEXEC), 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        return false;
+    }
+
+    if (readOnly) {
+        struct stat st{};
+        if (fstat(fd, &st) < 0) {
+            perror("fstat");
+            close();
+            return false;
+        }
+        mappedSize = std::min<long>(st.st_size, size);
+    } else {
+        // reserve the blocks up front, filesystems without fallocate just get a sparse file
+        int err = posix_fallocate(fd, 0, size);
+        if (err != 0 && ftruncate(fd, size) < 0) {
+            std::cerr << "Error: Cannot preallocate " << path << ": fallocate: " << strerror(err)
+                      << ", ftruncate: " << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+        mappedSize = size;
+    }
+
+    if (mappedSize > 0) {
+        int prot = readOnly ? PROT_READ : (PROT_READ | PROT_WRITE);
+        void* addr = mmap(nullptr, mappedSize, prot, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap");
+            close();
+            return false;
+        }
+        base = static_cast<unsigned char*>(addr);
+    }
+    return true;
+}
+
+void Storage::openDiscard(long fileSize) {
+    close();
+    size = fileSize;
+    discard = true;
+}
+
+void Storage::close() {
+    if (base) {
+        // every policy syncs on close, for None it's the only one the data gets
+        if (!readOnly) msync(base, mappedSize, MS_SYNC);
+        munmap(base, mappedSize);
+        base = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    mappedSize = 0;
+    discard = false;
+}
+
+bool Storage::write(long offset, const unsigned char* data, size_t len) {
+    if (discard) return offset >= 0 && offset + (long)len <= size;
+
+    unsigned char* dest = writableRange(offset, len);
+    if (!dest) return false;
+
+    memcpy(dest, data, len);
+    commit(offset, len);
+    return true;
+}
+
+unsigned char* Storage::writableRange(long offset, size_t len) const {
+    if (readOnly || !base || offset < 0 || offset + (long)len > mappedSize) return nullptr;
+    return base + offset;
+}
+
+void Storage::commit(long offset, size_t len) {
+    if (flushPolicy == FlushPolicy::Async) syncRange(offset, len, MS_ASYNC);
+    else if (flushPolicy == FlushPolicy::Sync) syncRange(offset, len, MS_SYNC);
+}
+
+bool Storage::read(long offset, unsigned char* out, size_t len) const {
+    if (offset < 0 || offset + (long)len > size) return false;
+
+    // anything past the mapped part (a short seed file) reads as zeros
+    size_t mapped = 0;
+    if (offset < mappedSize) {
+        mapped = std::min<size_t>(len, mappedSize - offset);
+        memcpy(out, base + offset, mapped);
+    }
+    memset(out + mapped, 0, len - mapped);
+    return true;
+}
+
+void Storage::flush() {
+    if (base && !readOnly) msync(base, mappedSize, MS_SYNC);
+}
+
+void Storage::syncRange(long offset, size_t len, int flags) {
+    // msync wants a page aligned start
+    static const long pageSize = sysconf(_SC_PAGESIZE);
+    long start = offset - (offset % pageSize);
+    msync(base + start, len + (offset - start), flags);
+}
@@ -0,0 +1,59 @@
+#ifndef BIT_TORRENT_STORAGE_H
+#define BIT_TORRENT_STORAGE_H
+
+#include <string>
+#include <cstddef>
+
+// When written pieces are pushed to disk
+enum class FlushPolicy {
+    None,   // leave it to the page cache, synced once on close
+    Async,  // msync(MS_ASYNC) after every write
+    Sync    // msync(MS_SYNC) after every write
+};
+
+// The shared file opened once, preallocated to its full size and memory mapped.
+// Reads and writes are by byte offset, callers must keep them inside [0, size)
+class Storage {
+public:
+    Storage() = default;
+    ~Storage();
+
+    Storage(const Storage&) = delete;
+    Storage& operator=(const Storage&) = delete;
+
+    // readOnly is for seeds: the file is never grown or written, missing bytes past EOF read as zeros
+    bool open(const std::string& path, long size, bool readOnly);
+    // No file at all: writes are accepted and dropped, everything reads as zeros. For simulated
+    // peers, which only track which pieces they have
+    void openDiscard(long size);
+    void close();
+
+    bool write(long offset, const unsigned char* data, size_t len);
+    // For filling the mapping in place: the range to write into (nullptr if read only or out of range),
+    // then commit() once the bytes are there to apply the flush policy
+    unsigned char* writableRange(long offset, size_t len) const;
+    void commit(long offset, size_t len);
+    bool read(long offset, unsigned char* out, size_t len) const;
+    void flush();
+
+    void setFlushPolicy(FlushPolicy policy) { flushPolicy = policy; }
+    bool isOpen() const { return fd >= 0 || discard; }
+    int getFd() const { return fd; }
+    long getSize() const { return size; }
+    // Mapped bytes, only valid for offsets below getMappedSize()
+    unsigned char* getData() const { return base; }
+    long getMappedSize() const { return mappedSize; }
+
+private:
+    int fd = -1;
+    long size = 0;
+    long mappedSize = 0;
+    bool readOnly = false;
+    bool discard = false;
+    unsigned char* base = nullptr;
+    FlushPolicy flushPolicy = FlushPolicy::None;
+
+    void syncRange(long offset, size_t len, int flags);
+};
+
+#endif //BIT_TORRENT_STORAGE_H
@@ -0,0 +1,57 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopping = true;
+    }
+    jobReady.notify_all();
+    for (std::thread& t : workers) {
+        if (t.joinable()) t.join();
+    }
+}
+
+void ThreadPool::start(int threads) {
+    if (!workers.empty()) return;
+    if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        jobs.push_back(std::move(job));
+    }
+    jobReady.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lk(mutex);
+    idle.wait(lk, [this] { return jobs.empty() && busy == 0; });
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+            jobReady.wait(lk, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            busy++;
+        }
+
+        job();
+
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            busy--;
+            if (jobs.empty() && busy == 0) idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef BIT_TORRENT_THREADPOOL_H
+#define BIT_TORRENT_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running submitted jobs in FIFO order. Used for piece hashing so the
+// socket threads never wait on SHA-256
+class ThreadPool {
+public:
+    ThreadPool() = default;
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // threads 0 = one per core minus one, at least one
+    void start(int threads = 0);
+    bool isRunning() const { return !workers.empty(); }
+
+    void submit(std::function<void()> job);
+
+    // Block until every job submitted so far has finished
+    void wait();
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable jobReady;
+    std::condition_variable idle;
+    int busy = 0;
+    bool stopping = false;
+
+    void workerLoop();
+};
+
+#endif //BIT_TORRENT_THREADPOOL_H
@@ -0,0 +1,61 @@
+#include "TimerQueue.h"
+#include <algorithm>
+
+void TimerQueue::at(Clock::time_point when, Callback fn) {
+    push({when, 0, Clock::duration::zero(), std::move(fn)});
+}
+
+void TimerQueue::every(Clock::time_point first, Clock::duration period, Callback fn) {
+    push({first, 0, period, std::move(fn)});
+}
+
+void TimerQueue::push(Entry entry) {
+    bool earliest;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entry.seq = nextSeq++;
+        earliest = heap.empty() || entry.when < heap.front().when;
+        heap.push_back(std::move(entry));
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+    if (earliest && onEarlier) onEarlier();
+}
+
+void TimerQueue::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    heap.clear();
+}
+
+TimerQueue::Clock::time_point TimerQueue::next() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return heap.empty() ? Clock::time_point::max() : heap.front().when;
+}
+
+int TimerQueue::runDue(Clock::time_point now) {
+    int ran = 0;
+    while (true) {
+        Entry entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (heap.empty() || heap.front().when > now) break;
+            std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+            entry = std::move(heap.back());
+            heap.pop_back();
+        }
+
+        entry.fn();
+        ran++;
+
+        if (entry.period > Clock::duration::zero()) {
+            entry.when += entry.period;
+            if (entry.when <= now) {
+                entry.when += ((now - entry.when) / entry.period + 1) * entry.period;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            entry.seq = nextSeq++;
+            heap.push_back(std::move(entry));
+            std::push_heap(heap.begin(), heap.end(), std::greater<>());
+        }
+    }
+    return ran;
+}
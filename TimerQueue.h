@@ -0,0 +1,53 @@
+#ifndef BIT_TORRENT_TIMERQUEUE_H
+#define BIT_TORRENT_TIMERQUEUE_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Every periodic and deadline job of a Peer (choke rounds, request timeouts, HAVE batch windows,
+// resume saves) in one min-heap, run by whoever owns the peer's clock: the reactor through a timerfd,
+// the timer thread in threaded mode, or swarmSim. Equal deadlines run in the order they were set.
+// Any thread may schedule. Callbacks run in runDue() without the queue's lock, so they can schedule more
+class TimerQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    // fn once, at when
+    void at(Clock::time_point when, Callback fn);
+    // fn at first and then every period, rounds that were missed entirely are skipped
+    void every(Clock::time_point first, Clock::duration period, Callback fn);
+    void clear();
+
+    // Earliest deadline, Clock::time_point::max() when nothing is scheduled
+    Clock::time_point next();
+    // Run everything due by now, returns how many ran
+    int runDue(Clock::time_point now);
+
+    // A timer was scheduled ahead of everything else, whoever sleeps until next() should look again.
+    // Called without the lock held, set before anything is scheduled
+    std::function<void()> onEarlier;
+
+private:
+    struct Entry {
+        Clock::time_point when;
+        uint64_t seq;
+        Clock::duration period;  // zero = one shot
+        Callback fn;
+
+        bool operator>(const Entry& other) const {
+            return when != other.when ? when > other.when : seq > other.seq;
+        }
+    };
+
+    std::mutex mutex;
+    std::vector<Entry> heap;
+    uint64_t nextSeq = 0;
+
+    void push(Entry entry);
+};
+
+#endif //BIT_TORRENT_TIMERQUEUE_H
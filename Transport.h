@@ -0,0 +1,24 @@
+#ifndef BIT_TORRENT_TRANSPORT_H
+#define BIT_TORRENT_TRANSPORT_H
+
+#include <chrono>
+#include <vector>
+
+// Where a Peer's bytes go instead of TCP sockets, and the clock its request timing runs on.
+// Connections are handles the transport hands out, small ints counted up from 0 like fds since the
+// peer indexes arrays with them, and the peer uses them wherever it would use a socket. Incoming
+// bytes are pushed in with Peer::receiveTransport, see SimNetwork for the in-memory one
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    virtual std::chrono::steady_clock::time_point now() = 0;
+
+    // One handshake or whole frame (PIECE bodies included) for the other end of conn, in order
+    virtual void send(int conn, std::vector<unsigned char> bytes) = 0;
+
+    // The peer is done with conn, the other end sees it close
+    virtual void close(int conn) = 0;
+};
+
+#endif //BIT_TORRENT_TRANSPORT_H
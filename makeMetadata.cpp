@@ -0,0 +1,52 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include "Metadata.h"
+
+// Usage: makeMetadata <Common.cfg> <file> [output]
+// Hashes <file> (normally the seed's copy) with the FileSize/PieceSize from Common.cfg and writes the
+// piece digests to output, by default <FileName>.meta next to Common.cfg. Peers pick it up through the
+// MetadataFile key
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " <Common.cfg> <file> [output]" << std::endl;
+        return 1;
+    }
+
+    std::string configPath = argv[1];
+    std::ifstream config(configPath);
+    if (!config.is_open()) {
+        std::cerr << "Error: Could not open " << configPath << std::endl;
+        return 1;
+    }
+
+    std::string fileName;
+    long fileSize = 0;
+    int pieceSize = 0;
+    std::string key, value;
+    while (config >> key >> value) {
+        if (key == "FileName") fileName = value;
+        else if (key == "FileSize") fileSize = std::stol(value);
+        else if (key == "PieceSize") pieceSize = std::stoi(value);
+    }
+    if (fileName.empty() || fileSize <= 0 || pieceSize <= 0) {
+        std::cerr << "Error: " << configPath << " needs FileName, FileSize and PieceSize" << std::endl;
+        return 1;
+    }
+
+    std::string output;
+    if (argc == 4) {
+        output = argv[3];
+    } else {
+        size_t slash = configPath.find_last_of('/');
+        output = (slash == std::string::npos ? "" : configPath.substr(0, slash + 1)) + fileName + ".meta";
+    }
+
+    Metadata metadata;
+    metadata.fileName = fileName;
+    if (!metadata.build(argv[2], fileSize, pieceSize)) return 1;
+    if (!metadata.save(output)) return 1;
+
+    std::cout << "Wrote " << metadata.pieceHashes.size() << " piece hashes to " << output << std::endl;
+    return 0;
+}
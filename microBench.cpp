@@ -0,0 +1,253 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "Bitfield.h"
+#include "PiecePicker.h"
+#include "FrameReader.h"
+#include "Storage.h"
+#include "Sha256.h"
+#include "Logger.h"
+
+// Microbenchmarks of the code every message or piece goes through. Each case runs its operation in
+// growing batches until a batch takes --min-time, then reports the time per operation of that batch.
+// Output is JSON with one entry per case in a fixed order, keyed by name + param, so runs diff cleanly
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::string name;
+    long param;      // problem size (pieces, bytes), 0 if the case has none
+    long iterations;
+    double nsPerOp;
+};
+
+struct Options {
+    double minTime = 0.2;
+    std::string filter;
+    std::string output;
+};
+
+// Keeps results alive so the compiler can't drop the work
+volatile long sink;
+
+struct Bench {
+    Options opt;
+    std::vector<Result> results;
+
+    // ops(n) runs the operation n times. Cases not matching --filter are skipped
+    void run(const std::string& name, long param, const std::function<void(long)>& ops) {
+        if (!opt.filter.empty() && name.find(opt.filter) == std::string::npos) return;
+
+        long n = 1;
+        while (true) {
+            auto start = Clock::now();
+            ops(n);
+            double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            if (elapsed >= opt.minTime || n >= (1L << 40)) {
+                results.push_back({name, param, n, elapsed * 1e9 / n});
+                std::cerr << name << " " << param << ": " << results.back().nsPerOp << " ns/op" << std::endl;
+                return;
+            }
+            // aim a bit past minTime so the next batch is usually the last
+            n = elapsed <= 0 ? n * 10 : std::max(n * 2, (long)(n * opt.minTime * 1.2 / elapsed));
+        }
+    }
+};
+
+Bitfield randomBitfield(size_t numPieces, double density, std::mt19937& rng) {
+    std::bernoulli_distribution has(density);
+    Bitfield bf(numPieces);
+    for (size_t i = 0; i < numPieces; i++) {
+        if (has(rng)) bf.set(i);
+    }
+    return bf;
+}
+
+void bitfieldCases(Bench& bench) {
+    std::mt19937 rng(1);
+    for (long pieces : {10000L, 1000000L}) {
+        Bitfield bf = randomBitfield(pieces, 0.5, rng);
+        std::vector<unsigned char> bytes = bf.toBytes();
+
+        bench.run("bitfield_to_bytes", pieces, [&](long n) {
+            for (long i = 0; i < n; i++) {
+                bf.toBytes(bytes.data());
+                sink = bytes[i % bytes.size()];
+            }
+        });
+        bench.run("bitfield_from_bytes", pieces, [&](long n) {
+            for (long i = 0; i < n; i++) {
+                sink = Bitfield::fromBytes(bytes.data(), bytes.size(), pieces).wordCount();
+            }
+        });
+
+        // peerHasInterestingPieces: worst case, they have nothing we lack so every word is looked at
+        Bitfield mine(pieces, true);
+        bench.run("has_interesting_pieces", pieces, [&](long n) {
+            for (long i = 0; i < n; i++) sink = bf.hasAnyNotIn(mine);
+        });
+    }
+}
+
+// selectRarestPiece: what the picker costs with 8 neighbors and a third of the pieces already ours
+void pickerCases(Bench& bench) {
+    std::mt19937 rng(2);
+    for (long pieces : {10000L, 100000L, 1000000L}) {
+        PiecePicker picker(pieces);
+        std::vector<Bitfield> neighbors;
+        for (int p = 0; p < 8; p++) {
+            neighbors.push_back(randomBitfield(pieces, 0.5, rng));
+            picker.addPeer(neighbors.back());
+        }
+        for (long i = 0; i < pieces; i += 3) picker.markHave(i);
+        const Bitfield& remote = neighbors[0];
+
+        bench.run("pick_rarest", pieces, [&](long n) {
+            for (long i = 0; i < n; i++) {
+                sink = picker.pickRarest([&](int idx) { return remote[idx]; }, rng);
+            }
+        });
+        // a HAVE arriving and a disconnect taking it back
+        bench.run("picker_have_update", pieces, [&](long n) {
+            for (long i = 0; i < n; i++) {
+                int idx = (i * 7919) % pieces;
+                picker.increment(idx);
+                picker.decrement(idx);
+            }
+            sink = picker.remaining();
+        });
+    }
+}
+
+// sendMessage framing and receive parsing, the parse side reads HAVEs back through a socketpair in
+// 64 KB bursts like a busy connection would
+void frameCases(Bench& bench) {
+    unsigned char have[4] = {0, 0, 1, 2};
+    bench.run("encode_frame_have", 4, [&](long n) {
+        for (long i = 0; i < n; i++) sink = encodeFrame(4, have, sizeof(have)).size();
+    });
+
+    std::vector<unsigned char> piece(32768 + 4, 7);
+    bench.run("encode_frame_piece", piece.size(), [&](long n) {
+        for (long i = 0; i < n; i++) sink = encodeFrame(7, piece.data(), piece.size()).size();
+    });
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return;
+    }
+    int bufSize = 1 << 20;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+
+    std::vector<unsigned char> burst;
+    std::vector<unsigned char> frame = encodeFrame(4, have, sizeof(have));
+    while (burst.size() + frame.size() <= 65536) burst.insert(burst.end(), frame.begin(), frame.end());
+    long framesPerBurst = burst.size() / frame.size();
+
+    FrameReader reader(1 << 20);
+    bench.run("parse_frames_have", framesPerBurst, [&](long n) {
+        Message msg;
+        long bursts = (n + framesPerBurst - 1) / framesPerBurst;
+        for (long b = 0; b < bursts; b++) {
+            if (write(fds[0], burst.data(), burst.size()) != (ssize_t)burst.size()) return;
+            long got = 0;
+            while (got < framesPerBurst && reader.fill(fds[1]) > 0) {
+                while (reader.next(msg)) got++;
+            }
+            sink = got;
+        }
+    });
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Logger::getCurrentTimestamp without the once a second cache
+void loggerCases(Bench& bench) {
+    time_t now = time(nullptr);
+    bench.run("format_timestamp", 0, [&](long n) {
+        for (long i = 0; i < n; i++) sink = formatTimestamp(now + (i & 1)).size();
+    });
+}
+
+// savePiece/loadPiece and the hash check, against a 64 MB mapped scratch file
+void storageCases(Bench& bench) {
+    const long fileSize = 64L << 20;
+    const int pieceSize = 32768;
+    const long numPieces = fileSize / pieceSize;
+    std::string path = "microbench_storage.tmp";
+
+    Storage storage;
+    if (!storage.open(path, fileSize, false)) return;
+    std::vector<unsigned char> piece(pieceSize, 0x5a);
+
+    bench.run("save_piece", pieceSize, [&](long n) {
+        for (long i = 0; i < n; i++) storage.write(((i * 7919) % numPieces) * pieceSize, piece.data(), pieceSize);
+    });
+    bench.run("load_piece", pieceSize, [&](long n) {
+        for (long i = 0; i < n; i++) {
+            storage.read(((i * 7919) % numPieces) * pieceSize, piece.data(), pieceSize);
+            sink = piece[i % pieceSize];
+        }
+    });
+    bench.run("sha256_piece", pieceSize, [&](long n) {
+        for (long i = 0; i < n; i++) sink = Sha256::hash(piece.data(), pieceSize)[i & 31];
+    });
+
+    storage.close();
+    std::remove(path.c_str());
+}
+
+void writeReport(std::ostream& os, const std::vector<Result>& results) {
+    os.setf(std::ios::fixed);
+    os.precision(1);
+    os << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        os << "    {\"name\": \"" << r.name << "\", \"param\": " << r.param << ", \"iterations\": " << r.iterations
+           << ", \"ns_per_op\": " << r.nsPerOp << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Bench bench;
+    Options& opt = bench.opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 < argc && arg == "--min-time") opt.minTime = std::stod(argv[++i]);
+        else if (i + 1 < argc && arg == "--filter") opt.filter = argv[++i];
+        else if (i + 1 < argc && arg == "--output") opt.output = argv[++i];
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--min-time seconds] [--filter substring] [--output file]" << std::endl;
+            return 1;
+        }
+    }
+
+    bitfieldCases(bench);
+    pickerCases(bench);
+    frameCases(bench);
+    loggerCases(bench);
+    storageCases(bench);
+
+    if (opt.output.empty()) {
+        writeReport(std::cout, bench.results);
+    } else {
+        std::ofstream out(opt.output, std::ios::trunc);
+        writeReport(out, bench.results);
+    }
+    return 0;
+}
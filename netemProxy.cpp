@@ -0,0 +1,470 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Network emulator: a TCP proxy between the peers of a PeerInfo.cfg. It listens on every listed port
+// and forwards to the same host on port + offset, where the peer really listens (ListenPortOffset in
+// Common.cfg). The handshake says who connected, so each direction of each connection gets that
+// link's one way latency and the sender's upload / receiver's download rate.
+// The stream is cut into MSS sized segments. TCP never hands a gap to the application, so a lost
+// segment shows up as a retransmission timeout and a reordered one as a shorter hold up, and either
+// way everything behind it waits too. That is what is emulated: a dropped segment arrives one RTO
+// late, a reordered one half an RTT late, and segments always arrive in order.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t SEGMENT = 1448;          // bytes per emulated packet
+constexpr size_t MAX_QUEUED = 1 << 20;    // per direction in flight, stop reading past this like a full socket buffer
+constexpr double MIN_RTO = 0.2;           // Linux' minimum retransmission timeout, seconds
+
+struct LinkParams {
+    double latency = 0;  // seconds one way
+    double jitter = 0;   // up to this much extra per segment
+    double loss = 0;     // per segment
+    double reorder = 0;  // per segment
+};
+
+struct PeerParams {
+    double up = 0;    // bytes/sec, 0 = unlimited
+    double down = 0;
+};
+
+struct Options {
+    std::string peerInfo = "PeerInfo.cfg";
+    int offset = 1000;
+    LinkParams link;
+    PeerParams peer;
+    std::map<int, PeerParams> peerOverrides;
+    std::map<std::pair<int, int>, LinkParams> linkOverrides;  // (lower ID, higher ID)
+    unsigned seed = 1;
+};
+
+struct Listed {
+    int id;
+    std::string host;
+    int port;
+};
+
+struct Segment {
+    Clock::time_point due;
+    std::vector<unsigned char> bytes;
+    size_t sent = 0;
+};
+
+// One direction of a proxied connection
+struct Direction {
+    int src = -1;  // fds
+    int dst = -1;
+    int srcPeer = -1;
+    int dstPeer = -1;
+    LinkParams params;
+    std::deque<Segment> queue;
+    size_t queued = 0;
+    Clock::time_point lastDue;
+    bool blocked = false;  // dst didn't take everything, wait for POLLOUT
+    bool eof = false;      // src closed, dst is shut down once the queue drains
+    bool shut = false;
+};
+
+struct Pipe {
+    int client = -1;
+    int server = -1;
+    int targetPeer = -1;
+    std::vector<unsigned char> hello;  // initiator bytes until its handshake identifies it
+    bool identified = false;
+    bool dead = false;
+    Direction up;    // initiator -> target
+    Direction down;  // target -> initiator
+};
+
+volatile sig_atomic_t stopping = 0;
+
+void onSignal(int) {
+    stopping = 1;
+}
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --peer-info PATH       peers to sit between (default PeerInfo.cfg)\n"
+              << "  --offset N             peers listen on their port + N (default 1000)\n"
+              << "  --latency-ms MS        one way latency of every link (default 0)\n"
+              << "  --jitter-ms MS         up to this much extra per segment, order is kept (default 0)\n"
+              << "  --loss P               per segment chance of a retransmission timeout (default 0)\n"
+              << "  --reorder P            per segment chance of arriving out of order (default 0)\n"
+              << "  --rate BYTES           upload bytes/sec of every peer, 0 = unlimited (default 0)\n"
+              << "  --down-rate BYTES      download bytes/sec of every peer, 0 = unlimited (default 0)\n"
+              << "  --peer ID up=B,down=B  rates for one peer\n"
+              << "  --link ID ID latency-ms=MS,jitter-ms=MS,loss=P,reorder=P  one link, both directions\n"
+              << "  --seed N               random seed for loss/reorder/jitter (default 1)\n"
+              << "Prints 'ready' once every port is listening, runs until SIGTERM/SIGINT\n";
+}
+
+// key=value,key=value into link or peer params, false on an unknown key
+bool parseParams(const std::string& spec, LinkParams* link, PeerParams* peer) {
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        std::string key = item.substr(0, eq);
+        double value = std::stod(item.substr(eq + 1));
+        if (link && key == "latency-ms") link->latency = value / 1000;
+        else if (link && key == "jitter-ms") link->jitter = value / 1000;
+        else if (link && key == "loss") link->loss = value;
+        else if (link && key == "reorder") link->reorder = value;
+        else if (peer && key == "up") peer->up = value;
+        else if (peer && key == "down") peer->down = value;
+        else return false;
+    }
+    return true;
+}
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    std::vector<std::pair<int, std::string>> peerSpecs;
+    std::vector<std::pair<std::pair<int, int>, std::string>> linkSpecs;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        std::string value = argv[++i];
+        bool ok = true;
+        if (arg == "--peer-info") opt.peerInfo = value;
+        else if (arg == "--offset") opt.offset = std::stoi(value);
+        else if (arg == "--latency-ms") opt.link.latency = std::stod(value) / 1000;
+        else if (arg == "--jitter-ms") opt.link.jitter = std::stod(value) / 1000;
+        else if (arg == "--loss") opt.link.loss = std::stod(value);
+        else if (arg == "--reorder") opt.link.reorder = std::stod(value);
+        else if (arg == "--rate") opt.peer.up = std::stod(value);
+        else if (arg == "--down-rate") opt.peer.down = std::stod(value);
+        else if (arg == "--seed") opt.seed = std::stoul(value);
+        else if (arg == "--peer" && i + 1 < argc) peerSpecs.push_back({std::stoi(value), argv[++i]});
+        else if (arg == "--link" && i + 2 < argc) {
+            int a = std::stoi(value);
+            int b = std::stoi(argv[++i]);
+            linkSpecs.push_back({{std::min(a, b), std::max(a, b)}, argv[++i]});
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    // overrides start from the global settings wherever those were given on the command line
+    for (auto& [id, spec] : peerSpecs) {
+        PeerParams params = opt.peer;
+        if (!parseParams(spec, nullptr, &params)) {
+            usage(argv[0]);
+            return false;
+        }
+        opt.peerOverrides[id] = params;
+    }
+    for (auto& [link, spec] : linkSpecs) {
+        LinkParams params = opt.link;
+        if (!parseParams(spec, &params, nullptr)) {
+            usage(argv[0]);
+            return false;
+        }
+        opt.linkOverrides[link] = params;
+    }
+    return true;
+}
+
+class Emulator {
+public:
+    explicit Emulator(const Options& opt) : opt(opt), rng(opt.seed) {}
+
+    bool listenAll();
+    void run();
+
+private:
+    const Options& opt;
+    std::mt19937 rng;
+    std::vector<Listed> listed;
+    std::vector<int> listeners;  // same order as listed
+    std::vector<std::unique_ptr<Pipe>> pipes;
+    std::map<int, Clock::time_point> upBusy;    // peer -> when its upload link is free
+    std::map<int, Clock::time_point> downBusy;
+
+    const LinkParams& linkParams(int a, int b) const;
+    const PeerParams& peerParams(int id) const;
+    void accept(size_t index);
+    void identify(Pipe& pipe);
+    void enqueue(Direction& d, const unsigned char* data, size_t len);
+    bool readInto(Pipe& pipe, bool fromClient);
+    bool flush(Direction& d);
+    void kill(Pipe& pipe);
+};
+
+const LinkParams& Emulator::linkParams(int a, int b) const {
+    auto it = opt.linkOverrides.find({std::min(a, b), std::max(a, b)});
+    return it == opt.linkOverrides.end() ? opt.link : it->second;
+}
+
+const PeerParams& Emulator::peerParams(int id) const {
+    auto it = opt.peerOverrides.find(id);
+    return it == opt.peerOverrides.end() ? opt.peer : it->second;
+}
+
+bool Emulator::listenAll() {
+    std::ifstream file(opt.peerInfo);
+    if (!file.is_open()) {
+        std::cerr << "Error: could not open " << opt.peerInfo << std::endl;
+        return false;
+    }
+    Listed entry;
+    int hasFile;
+    while (file >> entry.id >> entry.host >> entry.port >> hasFile) listed.push_back(entry);
+
+    for (const Listed& peer : listed) {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(peer.port);
+        if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+            std::cerr << "Error: cannot listen on port " << peer.port << ": " << strerror(errno) << std::endl;
+            close(sock);
+            return false;
+        }
+        listeners.push_back(sock);
+    }
+    return true;
+}
+
+// A neighbor connecting to listed peer index: connect on to where that peer really listens
+void Emulator::accept(size_t index) {
+    while (true) {
+        int client = ::accept4(listeners[index], nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) return;
+
+        const Listed& target = listed[index];
+        int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(target.port + opt.offset);
+        inet_pton(AF_INET, target.host.c_str(), &addr.sin_addr);
+        if (connect(server, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            std::cerr << "Error: cannot reach peer " << target.id << " on port " << target.port + opt.offset
+                      << ": " << strerror(errno) << std::endl;
+            close(server);
+            close(client);
+            continue;
+        }
+        fcntl(server, F_SETFL, fcntl(server, F_GETFL, 0) | O_NONBLOCK);
+
+        auto pipe = std::make_unique<Pipe>();
+        pipe->client = client;
+        pipe->server = server;
+        pipe->targetPeer = target.id;
+        pipe->up.src = pipe->down.dst = client;
+        pipe->up.dst = pipe->down.src = server;
+        pipes.push_back(std::move(pipe));
+    }
+}
+
+// The initiator's handshake ends with its peer ID, from then on both directions know their link
+void Emulator::identify(Pipe& pipe) {
+    int32_t idNet;
+    memcpy(&idNet, pipe.hello.data() + 28, 4);
+    int from = ntohl(idNet);
+
+    pipe.identified = true;
+    pipe.up.srcPeer = pipe.down.dstPeer = from;
+    pipe.up.dstPeer = pipe.down.srcPeer = pipe.targetPeer;
+    pipe.up.params = pipe.down.params = linkParams(from, pipe.targetPeer);
+
+    enqueue(pipe.up, pipe.hello.data(), pipe.hello.size());
+    pipe.hello.clear();
+}
+
+// Segment by segment: serialized on the sender's upload, across the link, serialized on the
+// receiver's download, plus whatever loss or reordering adds. Never before the previous segment
+void Emulator::enqueue(Direction& d, const unsigned char* data, size_t len) {
+    using Seconds = std::chrono::duration<double>;
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const PeerParams& sender = peerParams(d.srcPeer);
+    const PeerParams& receiver = peerParams(d.dstPeer);
+    Clock::time_point now = Clock::now();
+
+    for (size_t pos = 0; pos < len; pos += SEGMENT) {
+        size_t n = std::min(SEGMENT, len - pos);
+
+        Clock::time_point t = now;
+        if (sender.up > 0) {
+            Clock::time_point& busy = upBusy[d.srcPeer];
+            t = std::max(t, busy) + std::chrono::duration_cast<Clock::duration>(Seconds(n / sender.up));
+            busy = t;
+        }
+
+        double delay = d.params.latency + d.params.jitter * unit(rng);
+        if (d.params.loss > 0 && unit(rng) < d.params.loss) {
+            delay += std::max(MIN_RTO, 4 * d.params.latency);  // about two RTTs, never under the floor
+        } else if (d.params.reorder > 0 && unit(rng) < d.params.reorder) {
+            delay += d.params.latency;  // the receiver holds the gap for about half an RTT
+        }
+        t += std::chrono::duration_cast<Clock::duration>(Seconds(delay));
+
+        if (receiver.down > 0) {
+            Clock::time_point& busy = downBusy[d.dstPeer];
+            t = std::max(t, busy) + std::chrono::duration_cast<Clock::duration>(Seconds(n / receiver.down));
+            busy = t;
+        }
+
+        t = std::max(t, d.lastDue);
+        d.lastDue = t;
+        d.queue.push_back({t, std::vector<unsigned char>(data + pos, data + pos + n)});
+        d.queued += n;
+    }
+}
+
+// False if the connection is broken
+bool Emulator::readInto(Pipe& pipe, bool fromClient) {
+    Direction& d = fromClient ? pipe.up : pipe.down;
+    unsigned char buf[64 * 1024];
+    ssize_t r = recv(d.src, buf, sizeof(buf), 0);
+    if (r < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (r == 0) {
+        d.eof = true;
+        return true;
+    }
+
+    if (fromClient && !pipe.identified) {
+        pipe.hello.insert(pipe.hello.end(), buf, buf + r);
+        if (pipe.hello.size() >= 32) identify(pipe);
+        return true;
+    }
+    enqueue(d, buf, r);
+    return true;
+}
+
+// Write every segment that is due. False if the connection is broken
+bool Emulator::flush(Direction& d) {
+    Clock::time_point now = Clock::now();
+    d.blocked = false;
+    while (!d.queue.empty() && d.queue.front().due <= now) {
+        Segment& seg = d.queue.front();
+        ssize_t sent = send(d.dst, seg.bytes.data() + seg.sent, seg.bytes.size() - seg.sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                d.blocked = true;
+                return true;
+            }
+            return false;
+        }
+        seg.sent += sent;
+        if (seg.sent < seg.bytes.size()) continue;
+        d.queued -= seg.bytes.size();
+        d.queue.pop_front();
+    }
+
+    if (d.eof && d.queue.empty() && !d.shut) {
+        shutdown(d.dst, SHUT_WR);
+        d.shut = true;
+    }
+    return true;
+}
+
+void Emulator::kill(Pipe& pipe) {
+    close(pipe.client);
+    close(pipe.server);
+    pipe.dead = true;
+}
+
+void Emulator::run() {
+    std::vector<pollfd> fds;
+    while (!stopping) {
+        fds.clear();
+        for (int sock : listeners) fds.push_back({sock, POLLIN, 0});
+
+        // wake up for the next segment that is due on a connection that can take it
+        Clock::time_point wake = Clock::time_point::max();
+        for (auto& pipe : pipes) {
+            short clientEvents = 0, serverEvents = 0;
+            if (!pipe->up.eof && pipe->up.queued < MAX_QUEUED) clientEvents |= POLLIN;
+            if (!pipe->down.eof && pipe->down.queued < MAX_QUEUED) serverEvents |= POLLIN;
+            if (pipe->up.blocked) serverEvents |= POLLOUT;
+            if (pipe->down.blocked) clientEvents |= POLLOUT;
+            for (Direction* d : {&pipe->up, &pipe->down}) {
+                if (!d->blocked && !d->queue.empty()) wake = std::min(wake, d->queue.front().due);
+            }
+            fds.push_back({pipe->client, clientEvents, 0});
+            fds.push_back({pipe->server, serverEvents, 0});
+        }
+
+        timespec timeout{1, 0};
+        if (wake != Clock::time_point::max()) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wake - Clock::now()).count();
+            ns = std::clamp<long long>(ns, 0, 1000000000LL);
+            timeout = {(time_t)(ns / 1000000000LL), (long)(ns % 1000000000LL)};
+        }
+        if (ppoll(fds.data(), fds.size(), &timeout, nullptr) < 0 && errno != EINTR) {
+            perror("ppoll");
+            break;
+        }
+
+        size_t numPipes = pipes.size();  // accept() appends, those have no poll results yet
+        for (size_t i = 0; i < listeners.size(); i++) {
+            if (fds[i].revents & POLLIN) accept(i);
+        }
+
+        for (size_t i = 0; i < numPipes; i++) {
+            Pipe& pipe = *pipes[i];
+            const pollfd& client = fds[listeners.size() + 2 * i];
+            const pollfd& server = fds[listeners.size() + 2 * i + 1];
+            bool ok = true;
+            if (!pipe.up.eof && (client.revents & (POLLIN | POLLHUP | POLLERR))) ok = readInto(pipe, true);
+            if (!pipe.down.eof && (server.revents & (POLLIN | POLLHUP | POLLERR))) ok = readInto(pipe, false) && ok;
+            ok = ok && flush(pipe.up) && flush(pipe.down);
+            if (!ok || (pipe.up.shut && pipe.down.shut)) kill(pipe);
+        }
+        pipes.erase(std::remove_if(pipes.begin(), pipes.end(), [](const auto& p) { return p->dead; }), pipes.end());
+    }
+
+    for (auto& pipe : pipes) kill(*pipe);
+    for (int sock : listeners) close(sock);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, onSignal);
+    signal(SIGINT, onSignal);
+
+    Emulator emulator(opt);
+    if (!emulator.listenAll()) return 1;
+    std::cout << "ready" << std::endl;
+
+    emulator.run();
+    return 0;
+}
@@ -1,4 +1,3 @@
-#include <iostream>
 #include <thread>
 #include <vector>
 #include <cstring>
@@ -9,51 +8,165 @@
 #include <arpa/inet.h>
 #include <fstream>
 #include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include "peer.h"
+#include "Diagnostics.h"
 
-std::atomic<bool> running{true};
 constexpr int BUFFER_SIZE = 1024;
+constexpr int MAX_PIPELINE_DEPTH = 64;
+constexpr auto REQUEST_CHECK_SPACING = std::chrono::milliseconds(250);  // request timeout checks at most this often
 
-Peer::Peer(int id) : peerId(id), logger(*this) {
+Peer::Peer(int id, Transport* transport) : peerId(id), logger(*this), transport(transport) {
     loadCommonConfig("../Common.cfg");
     loadPeerInfo("../PeerInfo.cfg");
 
+    if (logToFile) logger.open();
+    if (asyncLogging) logger.startAsync();
+
     numPieces = (fileSize + pieceSize - 1) / pieceSize;
-    bitfield.resize(numPieces);
+    bitfield = Bitfield(numPieces, self.hasFile);
+
+    std::vector<int> neighborIDs;
+    for (const PeerInfo& info : peers) {
+        if (info.id != peerId) neighborIDs.push_back(info.id);
+    }
+    table.reset(neighborIDs, numPieces, std::max(1, rateWindow > 0 ? rateWindow : unchokingInterval));
+    piecesOwned = self.hasFile ? numPieces : 0;
+    downloadComplete = self.hasFile;
+
+    picker.reset(numPieces);
     if (self.hasFile) {
-        std::fill(bitfield.begin(), bitfield.end(), true);
-    } else {
-        std::fill(bitfield.begin(), bitfield.end(), false);
+        for (int i = 0; i < numPieces; i++) picker.markHave(i);
+    }
+
+    // simulated peers keep no data, only which pieces they have
+    if (transport) {
+        storage.openDiscard(fileSize);
+        return;
+    }
+
+    // what a previous run left behind, looked at before opening touches the file
+    long priorSize = -1;
+    long long priorMtime = 0;
+    ResumeState::fileStatus(getPieceFilePath(0), priorSize, priorMtime);
+
+    storage.setFlushPolicy(flushPolicy);
+    storage.open(getPieceFilePath(0), fileSize, self.hasFile);
+
+    if (!metadataFile.empty()) {
+        if (!metadata.load("../" + metadataFile)) {
+            metadata.pieceHashes.clear();
+        } else if (metadata.fileSize != fileSize || metadata.pieceSize != pieceSize ||
+                   (int)metadata.pieceHashes.size() != numPieces) {
+            diagError("Error: ", metadataFile, " doesn't match FileSize/PieceSize in Common.cfg, not verifying pieces");
+            metadata.pieceHashes.clear();
+        }
+        if (!metadata.pieceHashes.empty()) hashPool.start();
     }
+
+    restoreProgress(priorSize, priorMtime);
 }
 
 int Peer::getPeerId() {
     return peerId;
 }
 
+void Peer::seedRandom(unsigned seed) {
+    chokeRng.seed(seed);
+    pickRng.seed(chokeRng());
+}
+
+std::chrono::steady_clock::time_point Peer::now() {
+    return transport ? transport->now() : std::chrono::steady_clock::now();
+}
+
 void Peer::start() {
     signal(SIGPIPE, SIG_IGN);
-    srand(time(nullptr) + peerId);  // seed random for piece selection
+    seedRandom(time(nullptr) + peerId);
+
+    if (ioMode == IOMode::Reactor) {
+        if (!loop.open()) return;
+        // listen first so earlier peers' connects queue in the backlog, then the reactor owns every socket
+        if (openListenSocket() < 0) return;
+        fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL, 0) | O_NONBLOCK);
+        timers.onEarlier = [this] { loop.wakeup(); };
+        armTimers();
+        connectToPeers();
+
+        runReactor();  // on this thread, the timers fire through the loop's timerfd
+    } else {
+        std::thread listener(&Peer::listenForPeers, this);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));  // give listener time to start
 
-    std::thread listener(&Peer::listenForPeers, this);
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));  // give listener time to start
+        timers.onEarlier = [this] {
+            std::lock_guard<std::mutex> lock(timerMutex);
+            timerWake = true;
+            timerCv.notify_all();
+        };
+        armTimers();
+        connectToPeers();
 
-    connectToPeers();
+        timerLoop();  // until stop()
+        if (listener.joinable()) listener.join();
+        stopConnections();
+    }
 
-    // Start the timer threads for choking/unchoking
-    std::thread prefTimer(&Peer::preferredNeighborTimer, this);
-    std::thread optTimer(&Peer::optimisticUnchokeTimer, this);
+    if (!self.hasFile && resumeInterval > 0) saveResumeState();  // once more on the way out
+}
+
+// Choke rounds and resume saves. Request deadlines and HAVE batches schedule themselves as they come up
+void Peer::armTimers() {
+    auto start = now();
+    auto unchoke = std::chrono::seconds(unchokingInterval);
+    auto optimistic = std::chrono::seconds(optimisticUnchokingInterval);
+    timers.every(start + unchoke, unchoke, [this] { selectPreferredNeighbors(); });
+    timers.every(start + optimistic, optimistic, [this] { selectOptimisticallyUnchokedNeighbor(); });
+
+    if (!transport && !self.hasFile && resumeInterval > 0) {
+        auto resume = std::chrono::seconds(resumeInterval);
+        timers.every(start + resume, resume, [this] { saveResumeState(); });
+    }
+}
 
-    // Wait for threads to finish
-    if (prefTimer.joinable()) prefTimer.join();
-    if (optTimer.joinable()) optTimer.join();
-    if (listener.joinable()) listener.join();
+void Peer::runTimers() {
+    timers.runDue(now());
+}
+
+// Threaded mode: sleep until the next deadline, or until something earlier is scheduled or we stop
+void Peer::timerLoop() {
+    std::unique_lock<std::mutex> lock(timerMutex);
+    while (running) {
+        auto next = std::min(timers.next(), std::chrono::steady_clock::now() + std::chrono::hours(1));
+        timerCv.wait_until(lock, next, [this] { return !running || timerWake; });
+        timerWake = false;
+        if (!running) break;
+
+        lock.unlock();
+        runTimers();
+        lock.lock();
+    }
+}
+
+// Everyone has the file, wake whatever is sleeping so every loop sees running go false
+void Peer::stop() {
+    running = false;
+    loop.wakeup();
+    std::lock_guard<std::mutex> lock(timerMutex);
+    timerCv.notify_all();
 }
 
 int Peer::loadPeerInfo(const std::string& peerFile) {
     std::ifstream file(peerFile);
     if (!file.is_open()) {
-        std::cerr << "Error: could not open " << peerFile << std::endl;
+        diagError("Error: could not open ", peerFile);
         return 1;
     }
 
@@ -84,27 +197,83 @@ int Peer::loadPeerInfo(const std::string& peerFile) {
 int Peer::loadCommonConfig(const std::string& configFile) {
     std::ifstream file(configFile);
     if (!file.is_open()) {
-        std::cerr << "Error: Could not open Common.cfg" << std::endl;
+        diagError("Error: Could not open Common.cfg");
         return 1;
     }
 
+    // key/value pairs, the first six are required, anything after them is optional
     std::string key;
-    file >> key >> numPreferredNeighbors;
-    file >> key >> unchokingInterval;
-    file >> key >> optimisticUnchokingInterval;
-    file >> key >> fileName;
-    file >> key >> fileSize;
-    file >> key >> pieceSize;
+    while (file >> key) {
+        if (key == "NumberOfPreferredNeighbors") file >> numPreferredNeighbors;
+        else if (key == "UnchokingInterval") file >> unchokingInterval;
+        else if (key == "OptimisticUnchokingInterval") file >> optimisticUnchokingInterval;
+        else if (key == "FileName") file >> fileName;
+        else if (key == "FileSize") file >> fileSize;
+        else if (key == "PieceSize") file >> pieceSize;
+        else if (key == "IOMode") {
+            std::string mode;
+            file >> mode;
+            ioMode = (mode == "reactor") ? IOMode::Reactor : IOMode::Threaded;
+        } else if (key == "LogMode") {
+            std::string mode;
+            file >> mode;
+            asyncLogging = (mode == "async");
+            logToFile = (mode != "off");
+        } else if (key == "StorageFlush") {
+            std::string policy;
+            file >> policy;
+            if (policy == "sync") flushPolicy = FlushPolicy::Sync;
+            else if (policy == "async") flushPolicy = FlushPolicy::Async;
+            else flushPolicy = FlushPolicy::None;
+        } else if (key == "RequestPipelineDepth") {
+            std::string depth;
+            file >> depth;
+            char* end = nullptr;
+            long n = strtol(depth.c_str(), &end, 10);
+            if (depth == "auto") {
+                requestPipelineDepth = 0;
+            } else if (end == depth.c_str() || *end != '\0') {
+                diagError("Warning: RequestPipelineDepth ", depth, " is not a number, using auto");
+                requestPipelineDepth = 0;
+            } else {
+                requestPipelineDepth = (int)std::clamp(n, 1L, (long)INT_MAX);
+            }
+        } else if (key == "BlockSize") {
+            file >> blockSize;
+        } else if (key == "EndgameThreshold") {
+            file >> endgameThreshold;
+        } else if (key == "RequestTimeout") {
+            file >> requestTimeout;
+        } else if (key == "MetadataFile") {
+            file >> metadataFile;
+        } else if (key == "ResumeInterval") {
+            file >> resumeInterval;
+        } else if (key == "ListenPortOffset") {
+            file >> listenPortOffset;
+        } else if (key == "HaveBatchInterval") {
+            file >> haveBatchInterval;
+        } else if (key == "RateWindow") {
+            file >> rateWindow;
+        } else if (key == "DiagLevel") {
+            std::string level;
+            file >> level;
+            setDiagLevel(parseDiagLevel(level));
+        } else {
+            std::string ignored;
+            file >> ignored;
+            diagError("Warning: unknown Common.cfg key ", key);
+        }
+    }
 
     file.close();
     return 0;
 }
 
-int Peer::listenForPeers() {
+int Peer::openListenSocket() {
     int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket == -1) {
-        std::cerr << "Failed to create socket.\n";
-        return 1;
+        diagError("Failed to create socket.");
+        return -1;
     }
 
     int opt = 1;
@@ -113,45 +282,81 @@ int Peer::listenForPeers() {
     sockaddr_in serverAddr{};
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(self.port);
+    serverAddr.sin_port = htons(self.port + listenPortOffset);
 
     if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        perror("bind");
-        return 1;
+        diagError("bind: ", strerror(errno));
+        close(serverSocket);
+        return -1;
     }
 
-    if (listen(serverSocket, 5) < 0) {
-        perror("listen");
-        return 1;
+    if (listen(serverSocket, 64) < 0) {
+        diagError("listen: ", strerror(errno));
+        close(serverSocket);
+        return -1;
     }
 
-    std::cout << "Peer " << peerId << " listening on port " << self.port << "...\n";
+    diagInfo("Peer ", peerId, " listening on port ", self.port + listenPortOffset, "...");
+    listenSocket = serverSocket;
+    return serverSocket;
+}
 
-    std::vector<std::thread> threads;
+int Peer::listenForPeers() {
+    int serverSocket = openListenSocket();
+    if (serverSocket < 0) return 1;
 
+    // polled so the loop notices running going false instead of sitting in accept forever
+    pollfd pfd{serverSocket, POLLIN, 0};
     while (running) {
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
         sockaddr_in clientAddr{};
         socklen_t clientSize = sizeof(clientAddr);
         int clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientSize);
 
         if (clientSocket >= 0) {
-            threads.emplace_back(&Peer::handleConnection, this, clientSocket, false);
+            std::lock_guard<std::mutex> lg(socketMutex);
+            connectionThreads.emplace_back(&Peer::handleConnection, this, clientSocket, false);
         }
     }
 
-    for (auto& t : threads)
-        if (t.joinable()) t.join();
-
     close(serverSocket);
+    listenSocket = -1;
     return 0;
 }
 
+// Threaded mode shutdown: kick every connection thread out of its recv and wait for all of them,
+// none may outlive the Peer
+void Peer::stopConnections() {
+    std::vector<int> sockets;
+    {
+        std::lock_guard<std::mutex> lg(socketMutex);
+        for (int sock : table.sockets) {
+            if (sock >= 0) sockets.push_back(sock);
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    for (int sock : sockets) drainOutbound(sock, deadline);
+
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lg(socketMutex);
+        for (int sock : table.sockets) {
+            if (sock >= 0) shutdown(sock, SHUT_RDWR);
+        }
+        threads.swap(connectionThreads);
+    }
+    for (auto& t : threads) {
+        if (t.joinable()) t.join();
+    }
+}
+
 int Peer::connectToPeers() {
     for (auto& peerInfo : peers) {
         if (peerInfo.id < this->peerId) {  // connect only to earlier peers
             int sock = socket(AF_INET, SOCK_STREAM, 0);
             if (sock == -1) {
-                std::cerr << "Failed to create socket.\n";
+                diagError("Failed to create socket.");
                 return 1;
             }
 
@@ -162,14 +367,19 @@ int Peer::connectToPeers() {
             inet_pton(AF_INET, peerInfo.hostName.c_str(), &serverAddr.sin_addr);
 
             if (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-                std::cerr << "Connection failed.\n";
+                diagError("Connection failed.");
                 return 1;
             }
 
             // send handshake
             sendHandshake(sock);
-            // handle connection in a new thread
-            std::thread(&Peer::handleConnection, this, sock, true).detach();
+            if (ioMode == IOMode::Reactor) {
+                addConnection(sock, true);
+            } else {
+                // handle connection in a new thread
+                std::lock_guard<std::mutex> lg(socketMutex);
+                connectionThreads.emplace_back(&Peer::handleConnection, this, sock, true);
+            }
             logger.logTCPConnectionMade(peerInfo.id);
 
         }
@@ -178,30 +388,284 @@ int Peer::connectToPeers() {
 }
 
 void Peer::handleConnection(int sock, bool isInitiator) {
-    int remoteID = -1;
+    Connection conn;
+    conn.sock = sock;
+    conn.isInitiator = isInitiator;
+    conn.reader.setMaxFrame(maxFrameLength());
+    std::thread writer;
+
+    // same decoding as the reactor, just with a blocking recv in front of it
+    while (running) {
+        if (conn.reader.fill(sock) <= 0) break;
+        bool ok = processFrames(conn);
+        if (conn.handshakeDone && !writer.joinable()) {
+            writer = std::thread(&Peer::writerLoop, this, outboundFor(sock));
+        }
+        if (!ok) break;
+    }
+
+    if (!conn.handshakeDone) {
+        close(sock);
+        return;
+    }
+
+    // on the way out the last HAVEs still have to reach the neighbor, then the shutdown kicks the
+    // writer out of a send that would never finish
+    if (!running) drainOutbound(sock, std::chrono::steady_clock::now() + std::chrono::seconds(1));
+    closeOutbound(sock);
+    shutdown(sock, SHUT_RDWR);
+    writer.join();
+
+    forgetSocket(conn.remoteID, sock);
+    close(sock);
+
+    handleDisconnect(conn.remoteID);
+}
 
+// Shared by both IO modes once the remote handshake has been read
+void Peer::onHandshakeComplete(int sock, int remoteID, bool isInitiator) {
     if (isInitiator) {
         // Already sent handshake in connectToPeers
-        if (!receiveHandshake(sock, remoteID)) { close(sock); return; }
         logger.logTCPConnectionMade(remoteID);
     } else {
-        if (!receiveHandshake(sock, remoteID)) { close(sock); return; }
         sendHandshake(sock);
         logger.logTCPConnectionReceived(remoteID);
     }
 
+    // from here on everything is written through the queue
+    openOutbound(sock, table.slotOf(remoteID));
     {
         std::lock_guard<std::mutex> lg(socketMutex);
-        peerSockets[remoteID] = sock;
+        table.sockets[table.slotOf(remoteID)] = sock;
     }
 
     sendBitfield(sock);
+}
+
+// The connection's socket, -1 when we aren't connected to remoteID
+int Peer::socketOf(int remoteID) {
+    int slot = table.slotOf(remoteID);
+    if (slot < 0) return -1;
+    std::lock_guard<std::mutex> lg(socketMutex);
+    return table.sockets[slot];
+}
+
+// Unless a newer connection to the same peer took the slot already
+void Peer::forgetSocket(int remoteID, int sock) {
+    int slot = table.slotOf(remoteID);
+    if (slot < 0) return;
+    std::lock_guard<std::mutex> lg(socketMutex);
+    if (table.sockets[slot] == sock) table.sockets[slot] = -1;
+}
+
+// IDs of the neighbors we have a connection to, in slot order
+std::vector<int> Peer::connectedNeighbors() {
+    std::vector<int> ids;
+    std::lock_guard<std::mutex> lg(socketMutex);
+    for (int slot = 0; slot < table.size(); slot++) {
+        if (table.sockets[slot] >= 0) ids.push_back(table.ids[slot]);
+    }
+    return ids;
+}
+
+// Transport mode: connections go through the same Connection/processFrames path as the reactor,
+// with the transport pushing bytes in instead of epoll
+void Peer::openTransportConnection(int conn, bool isInitiator) {
+    Connection& c = openConnection(conn);
+    c.sock = conn;
+    c.isInitiator = isInitiator;
+    c.reader.setMaxFrame(maxFrameLength());
+    if (isInitiator) sendHandshake(conn);
+}
+
+bool Peer::receiveTransport(int conn, const unsigned char* data, size_t len) {
+    Connection* found = connectionFor(conn);
+    if (!found) return false;
+    Connection& c = *found;
+
+    while (len > 0) {
+        size_t taken = c.reader.append(data, len);
+        data += taken;
+        len -= taken;
+        if (!processFrames(c)) {
+            closeConnection(conn);
+            return false;
+        }
+    }
+    c.reader.trim();
+    return true;
+}
+
+void Peer::closeTransportConnection(int conn) {
+    closeConnection(conn);
+}
 
+// reactor mode - a single thread owns every socket and parses frames as bytes arrive
+void Peer::runReactor() {
+    loop.add(listenSocket, EPOLLIN, [this](uint32_t) { acceptPeers(); });
+    loop.onTimer = [this] { runTimers(); };
+
+    // no poll timeout, the timerfd wakes us for the next deadline and stop() through the wakeup fd
     while (running) {
-        Message msg;
-        if (!receiveMessage(sock, msg)) break;
-        handleMessage(remoteID, msg);
+        loop.setTimer(timers.next());
+        if (loop.poll(-1) < 0) {
+            diagError("epoll_wait: ", strerror(errno));
+            break;
+        }
+        flushPendingWrites();
+    }
+    flushPendingWrites();  // running may have gone false on another thread right after queueing the last HAVEs
+
+    std::vector<int> open;
+    for (auto& conn : connections) {
+        if (conn) open.push_back(conn->sock);
+    }
+    for (int sock : open) closeConnection(sock);
+
+    loop.remove(listenSocket);
+    close(listenSocket);
+    listenSocket = -1;
+}
+
+void Peer::addConnection(int sock, bool isInitiator) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    Connection& conn = openConnection(sock);
+    conn.sock = sock;
+    conn.isInitiator = isInitiator;
+    conn.reader.setMaxFrame(maxFrameLength());
+
+    loop.add(sock, EPOLLIN | EPOLLRDHUP, [this, sock](uint32_t events) {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) onReadable(sock);
+        if (events & EPOLLOUT) onWritable(sock);
+    });
+}
+
+Connection& Peer::openConnection(int sock) {
+    if (sock >= (int)connections.size()) connections.resize(sock + 1);
+    connections[sock] = std::make_unique<Connection>();
+    return *connections[sock];
+}
+
+Connection* Peer::connectionFor(int sock) {
+    return sock >= 0 && sock < (int)connections.size() ? connections[sock].get() : nullptr;
+}
+
+void Peer::acceptPeers() {
+    while (true) {
+        sockaddr_in clientAddr{};
+        socklen_t clientSize = sizeof(clientAddr);
+        int clientSocket = accept(listenSocket, (sockaddr*)&clientAddr, &clientSize);
+        if (clientSocket < 0) {
+            if (errno == EINTR) continue;
+            break;  // EAGAIN, backlog drained
+        }
+        addConnection(clientSocket, false);
+    }
+}
+
+void Peer::onReadable(int sock) {
+    Connection* found = connectionFor(sock);
+    if (!found) return;
+    Connection& conn = *found;
+
+    // bounded so one busy neighbor can't starve the rest, level triggered epoll brings us back
+    for (int reads = 0; reads < 16; ++reads) {
+        ssize_t r = conn.reader.fill(sock);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            closeConnection(sock);
+            return;
+        }
+        if (r < 0) break;
+
+        if (!processFrames(conn)) {
+            closeConnection(sock);
+            return;
+        }
+        if (!conn.reader.lastFillWasFull()) break;
+    }
+}
+
+// Decode every complete handshake/frame the reader holds, the partial tail stays for the next read
+bool Peer::processFrames(Connection& conn) {
+    FrameReader& reader = conn.reader;
+
+    if (!conn.handshakeDone) {
+        if (reader.buffered() < 32) return true;
+        int remoteID = -1;
+        if (!parseHandshake(reader.peek(), remoteID)) return false;
+        conn.remoteID = remoteID;
+        conn.handshakeDone = true;
+        reader.consume(32);
+        onHandshakeComplete(conn.sock, remoteID, conn.isInitiator);
+
+        // PIECE bodies are received straight into the mapped file
+        size_t headerLen = table.has(table.slotOf(remoteID), PeerTable::BlockTransfer) ? 8 : 4;
+        reader.setBodySink(7, headerLen, [this, remoteID, headerLen](const unsigned char* header, size_t bodyLength) {
+            return pieceDestination(remoteID, header, headerLen, bodyLength);
+        });
+    }
+
+    Message msg;
+    while (running && reader.next(msg)) {
+        handleMessage(conn.remoteID, msg);
     }
+    return !reader.failed();
+}
+
+// Nothing legitimate is longer than a whole piece or our bitfield plus a header
+size_t Peer::maxFrameLength() {
+    return 16 + std::max<size_t>(pieceSize, bitfield.byteSize());
+}
+
+// EPOLLOUT is only armed while a queue has more than the socket would take
+void Peer::onWritable(int sock) {
+    if (!connectionFor(sock)) return;
+    std::shared_ptr<OutboundQueue> q = outboundFor(sock);
+    if (!q) return;
+
+    WriteStatus status = writeQueued(*q);
+    if (status == WriteStatus::Drained) loop.modify(sock, EPOLLIN | EPOLLRDHUP);
+    else if (status == WriteStatus::Failed) closeConnection(sock);
+}
+
+// Write out the queues that got frames since the last poll, everything queued while handling one
+// batch of reads goes out together
+void Peer::flushPendingWrites() {
+    std::vector<std::shared_ptr<OutboundQueue>> ready;
+    {
+        std::lock_guard<std::mutex> lk(pendingWritesMutex);
+        ready.swap(pendingWrites);
+    }
+
+    for (auto& q : ready) {
+        if (q->closed) continue;  // only the reactor closes queues in this mode
+        WriteStatus status = writeQueued(*q);
+        if (status == WriteStatus::WouldBlock) loop.modify(q->sock, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+        else if (status == WriteStatus::Failed) closeConnection(q->sock);
+    }
+}
+
+void Peer::closeConnection(int sock) {
+    Connection* conn = connectionFor(sock);
+    if (!conn) return;
+    int remoteID = conn->remoteID;
+
+    bool handshakeDone = conn->handshakeDone;
+
+    closeOutbound(sock);
+    if (transport) {
+        transport->close(sock);
+    } else {
+        loop.remove(sock);
+        close(sock);
+    }
+    connections[sock].reset();
+
+    forgetSocket(remoteID, sock);
+
+    if (handshakeDone) handleDisconnect(remoteID);
 }
 
 
@@ -212,72 +676,278 @@ void Peer::sendHandshake(int socket) {
     const char* header = "P2PFILESHARINGPROJ";
     std::memcpy(msg.data(), header, 18);
 
+    if (blockSize > 0) msg[HS_FLAGS_OFFSET] |= HS_BLOCK_TRANSFER;
+    msg[HS_FLAGS_OFFSET] |= HS_MULTI_HAVE;
+
     int32_t idN = htonl(peerId);
     memcpy(msg.data() + 28, &idN, 4);
 
-    send(socket, msg.data(), msg.size(), 0);
+    if (transport) transport->send(socket, std::move(msg));
+    else sendAll(socket, msg.data(), msg.size());
 }
 
-bool Peer::receiveHandshake(int socket, int &remotePeerID) {
-    unsigned char hs[32];
-
-    ssize_t bytes = readNBytes(socket, hs, 32);
-    if (bytes != 32)
-        return false;
-
+bool Peer::parseHandshake(const unsigned char* hs, int &remotePeerID) {
     int32_t id;
     memcpy(&id, hs + 28, sizeof(id));
     remotePeerID = ntohl(id);
-    std::cout << "Peer " << peerId << " received handshake from Peer " << remotePeerID << std::endl;
+    diagInfo("Peer ", peerId, " received handshake from Peer ", remotePeerID);
+
+    int slot = table.slotOf(remotePeerID);
+    if (slot < 0) {
+        diagError("Peer ", remotePeerID, " isn't in PeerInfo.cfg, dropping the connection");
+        return false;
+    }
+
+    // block transfer only if we both want it, messages from this peer aren't handled until we return
+    table.set(slot, PeerTable::BlockTransfer, blockSize > 0 && (hs[HS_FLAGS_OFFSET] & HS_BLOCK_TRANSFER));
+    table.set(slot, PeerTable::MultiHave, hs[HS_FLAGS_OFFSET] & HS_MULTI_HAVE);
     return true;
 }
 
 void Peer::sendBitfield(int socket) {
     auto payload = bitfieldToBytes();
     sendMessage(socket, 5, payload); // type 5 == bitfield
-    std::cout << "Peer " << peerId << " sent bitfield" << std::endl;
+    diagDebug("Peer ", peerId, " sent bitfield");
 }
 
-bool Peer::receiveMessage(int socket, Message &msg) {
-    // Format: length (4 bytes), type = 5, payload = bitfield
-    uint32_t lenNet;
-    if (readNBytes(socket, &lenNet, 4) <= 0) return false;
+bool Peer::sendMessage(int socket, unsigned char type, const std::vector<unsigned char> &payload) {
+    // a choked neighbor's requests are void, don't spend upload on the PIECEs still queued for it
+    if (type == 0) dropQueuedPieces(socket, -1, 0);
+
+    OutboundFrame frame;
+    frame.bytes = encodeFrame(type, payload.data(), payload.size());
+    return queueFrame(socket, std::move(frame), type == 7);
+}
 
-    msg.length = ntohl(lenNet);
+// Write the whole buffer. Reactor sockets are non-blocking so wait for POLLOUT instead of failing on EAGAIN
+bool Peer::sendAll(int sock, const void* data, size_t len, int flags) {
+    const char* ptr = (const char*)data;
+    while (len > 0) {
+        ssize_t sent = send(sock, ptr, len, MSG_NOSIGNAL | flags);
+        if (sent > 0) {
+            ptr += sent;
+            len -= sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd pfd{sock, POLLOUT, 0};
+            poll(&pfd, 1, 100);
+            if (!running) return false;
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
 
-    // read type
-    if (readNBytes(socket, &msg.type, 1) <= 0) return false;
+std::shared_ptr<OutboundQueue> Peer::openOutbound(int sock, int slot) {
+    auto q = std::make_shared<OutboundQueue>();
+    q->sock = sock;
+    q->slot = slot;
+    std::lock_guard<std::mutex> lg(socketMutex);
+    if (sock >= (int)outboundQueues.size()) outboundQueues.resize(sock + 1);
+    outboundQueues[sock] = q;
+    return q;
+}
 
-    int payloadLen = msg.length - 1;
+std::shared_ptr<OutboundQueue> Peer::outboundFor(int sock) {
+    std::lock_guard<std::mutex> lg(socketMutex);
+    return sock >= 0 && sock < (int)outboundQueues.size() ? outboundQueues[sock] : nullptr;
+}
 
-    msg.payload.resize(payloadLen);
-    if (payloadLen > 0) {
-        if (readNBytes(socket, msg.payload.data(), payloadLen) <= 0) return false;
+// Drop whatever is still queued and wake the writer so it can exit. Must happen before the socket
+// is closed, otherwise a reused fd could pick up this queue
+void Peer::closeOutbound(int sock) {
+    std::shared_ptr<OutboundQueue> q;
+    {
+        std::lock_guard<std::mutex> lg(socketMutex);
+        if (sock < 0 || sock >= (int)outboundQueues.size() || !outboundQueues[sock]) return;
+        q = std::move(outboundQueues[sock]);
     }
 
-    return true;
+    {
+        std::lock_guard<std::mutex> lk(q->mutex);
+        q->closed = true;
+        q->control.clear();
+        q->bulk.clear();
+    }
+    q->cv.notify_one();
+    q->drainedCv.notify_all();
 }
 
-bool Peer::sendMessage(int socket, unsigned char type, const std::vector<unsigned char> &payload) {
-    uint32_t length = 1 + payload.size();
-    uint32_t lenNet = htonl(length);
+// Threaded mode shutdown: wait until the writer has put whatever control frames are queued on the
+// wire. PIECEs not started yet are dropped, everyone has the file by now
+void Peer::drainOutbound(int sock, std::chrono::steady_clock::time_point deadline) {
+    std::shared_ptr<OutboundQueue> q = outboundFor(sock);
+    if (!q) return;
 
-    // full message buffer
-    std::vector<unsigned char> buf(4 + length);
-    memcpy(buf.data(), &lenNet, 4);
-    buf[4] = type;
+    std::unique_lock<std::mutex> lk(q->mutex);
+    q->bulk.clear();
+    q->drainedCv.wait_until(lk, deadline, [&] { return q->closed || q->idle; });
+}
 
-    memcpy(buf.data() + 5, payload.data(), payload.size());
+// Hand a frame to the socket's writer. False if the connection is gone
+bool Peer::queueFrame(int sock, OutboundFrame frame, bool isBulk) {
+    std::shared_ptr<OutboundQueue> q = outboundFor(sock);
+    if (!q) return false;
+
+    // a transport takes whole frames right away, there is nothing to stream from
+    if (transport) {
+        if (frame.bodyLength > 0) {
+            size_t headerLen = frame.bytes.size();
+            frame.bytes.resize(headerLen + frame.bodyLength);
+            storage.read(frame.bodyOffset, frame.bytes.data() + headerLen, frame.bodyLength);
+            recordUpload(q->slot, frame.bodyLength);
+        }
+        transport->send(sock, std::move(frame.bytes));
+        return true;
+    }
 
-    ssize_t sent = send(socket, buf.data(), buf.size(), 0);
-    if (sent != static_cast<ssize_t>(buf.size())) {
-        // Connection closed, just return false instead of crashing
-        return false;
+    bool wakeReactor = false;
+    {
+        std::lock_guard<std::mutex> lk(q->mutex);
+        if (q->closed) return false;
+        (isBulk ? q->bulk : q->control).push_back(std::move(frame));
+        q->idle = false;
+        if (ioMode == IOMode::Reactor && !q->pending) {
+            q->pending = true;
+            wakeReactor = true;
+        }
     }
 
+    if (ioMode == IOMode::Threaded) {
+        q->cv.notify_one();
+    } else if (wakeReactor) {
+        {
+            std::lock_guard<std::mutex> lk(pendingWritesMutex);
+            pendingWrites.push_back(q);
+        }
+        loop.wakeup();
+    }
     return true;
 }
 
+// Forget PIECEs that haven't started going out yet. pieceIndex -1 drops all of them
+int Peer::dropQueuedPieces(int sock, int pieceIndex, int offset) {
+    std::shared_ptr<OutboundQueue> q = outboundFor(sock);
+    if (!q) return 0;
+
+    std::lock_guard<std::mutex> lk(q->mutex);
+    size_t before = q->bulk.size();
+    q->bulk.erase(std::remove_if(q->bulk.begin(), q->bulk.end(), [&](const OutboundFrame& f) {
+        return pieceIndex < 0 || (f.pieceIndex == pieceIndex && f.offset == offset);
+    }), q->bulk.end());
+    return before - q->bulk.size();
+}
+
+// Write as much of the queue as the socket takes. Each round takes every queued control frame plus at
+// most one PIECE, sends all their bytes with one sendmsg and then streams the PIECE body with sendfile.
+// On WouldBlock the unfinished round stays in q.batch for the next call. Only the queue's writer calls this
+WriteStatus Peer::writeQueued(OutboundQueue& q) {
+    constexpr size_t MAX_BATCH = 64;
+
+    while (true) {
+        if (q.batch.empty()) {
+            std::lock_guard<std::mutex> lk(q.mutex);
+            while (!q.control.empty() && q.batch.size() < MAX_BATCH - 1) {
+                q.batch.push_back(std::move(q.control.front()));
+                q.control.pop_front();
+            }
+            if (!q.bulk.empty()) {
+                q.batch.push_back(std::move(q.bulk.front()));
+                q.bulk.pop_front();
+            }
+            if (q.batch.empty()) {
+                q.pending = false;
+                q.idle = true;
+                q.drainedCv.notify_all();
+                return WriteStatus::Drained;
+            }
+            q.bytesSent = 0;
+            q.bodySent = 0;
+        }
+
+        const OutboundFrame& last = q.batch.back();
+        size_t total = 0;
+        for (const OutboundFrame& f : q.batch) total += f.bytes.size();
+
+        while (q.bytesSent < total) {
+            // skip whatever an earlier partial write already got out
+            iovec iov[MAX_BATCH];
+            int iovcnt = 0;
+            size_t skip = q.bytesSent;
+            for (OutboundFrame& f : q.batch) {
+                if (skip >= f.bytes.size()) {
+                    skip -= f.bytes.size();
+                    continue;
+                }
+                iov[iovcnt].iov_base = f.bytes.data() + skip;
+                iov[iovcnt].iov_len = f.bytes.size() - skip;
+                iovcnt++;
+                skip = 0;
+            }
+
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            // a PIECE header is held back until its body follows
+            ssize_t sent = sendmsg(q.sock, &msg, MSG_NOSIGNAL | (last.bodyLength > 0 ? MSG_MORE : 0));
+            if (sent > 0) {
+                q.bytesSent += sent;
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return WriteStatus::WouldBlock;
+            return WriteStatus::Failed;
+        }
+
+        // PIECE body straight from the file, padded with zeros if the file is shorter than FileSize
+        while (q.bodySent < last.bodyLength) {
+            size_t left = last.bodyLength - q.bodySent;
+            off_t pos = last.bodyOffset + q.bodySent;
+            ssize_t sent = sendfile(q.sock, storage.getFd(), &pos, left);
+            if (sent == 0) {
+                static const unsigned char zeros[4096] = {};
+                sent = send(q.sock, zeros, std::min(left, sizeof(zeros)), MSG_NOSIGNAL);
+            }
+            if (sent > 0) {
+                q.bodySent += sent;
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return WriteStatus::WouldBlock;
+            return WriteStatus::Failed;
+        }
+
+        if (last.bodyLength > 0) recordUpload(q.slot, last.bodyLength);
+        q.batch.clear();
+    }
+}
+
+// Threaded mode: the only thread that writes to this connection's socket
+void Peer::writerLoop(std::shared_ptr<OutboundQueue> q) {
+    if (!q) return;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(q->mutex);
+            q->cv.wait(lk, [&] { return q->closed || !q->control.empty() || !q->bulk.empty(); });
+            if (q->closed) return;
+        }
+
+        if (writeQueued(*q) == WriteStatus::Failed) {
+            // the reader notices too and tears the connection down, just stop taking frames
+            std::lock_guard<std::mutex> lk(q->mutex);
+            q->closed = true;
+            q->control.clear();
+            q->bulk.clear();
+            q->drainedCv.notify_all();
+            return;
+        }
+    }
+}
+
 void Peer::handleMessage(int remoteID, const Message &msg) {
     switch (msg.type) {
         case 0: handleChoke(remoteID); break;
@@ -287,596 +957,1274 @@ void Peer::handleMessage(int remoteID, const Message &msg) {
         case 4:  handleHave(remoteID, msg.payload); break;
         case 5:  handleBitfield(remoteID, msg.payload); break;
         case 6:  handleRequest(remoteID, msg.payload); break;
-        case 7:  handlePiece(remoteID, msg.payload); break;
+        case 7:  handlePiece(remoteID, msg.payload, msg.placedBytes); break;
+        case 8:  handleCancel(remoteID, msg.payload); break;
+        case MSG_HAVE_MULTI: handleHaveMulti(remoteID, msg.payload); break;
         default:
-            std::cerr << "Unknown message type " << (int)msg.type << "\n";
+            diagError("Unknown message type ", (int)msg.type);
     }
 }
 
 void Peer::handleInterested(int remoteID) {
-    neighborStates[remoteID].peerInterested = true;
+    table.set(table.slotOf(remoteID), PeerTable::PeerInterested, true);
     logger.logReceivingInterested(remoteID);
 }
 
 void Peer::handleNotInterested(int remoteID) {
-    neighborStates[remoteID].peerInterested = false;
+    table.set(table.slotOf(remoteID), PeerTable::PeerInterested, false);
     logger.logReceivingNotInterested(remoteID);
 }
 
 void Peer::handleChoke(int remoteID) {
-    neighborStates[remoteID].peerChoking = true;
+    table.set(table.slotOf(remoteID), PeerTable::PeerChoking, true);
     logger.logChoking(remoteID);
 
-    std::cout << "Peer " << peerId << " is choked by peer " << remoteID << std::endl;
+    diagDebug("Peer ", peerId, " is choked by peer ", remoteID);
+
+    // Clear any pending requests from this peer before !
+    releaseRequests(remoteID);
+}
+
+// Hand every block still requested from remoteID back to the pool
+void Peer::releaseRequests(int remoteID) {
+    std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+    auto it = piecesInProgress.begin();
+    while (it != piecesInProgress.end()) {
+        PieceProgress& progress = it->second;
+        bool requestedElsewhere = false;
+        for (size_t b = 0; b < progress.blockOwner.size(); b++) {
+            if (progress.blockOwner[b] == remoteID && !progress.blockDone[b]) {
+                progress.blockOwner[b] = -1;
+                diagTrace("Peer ", peerId, " clearing pending request for piece ",
+                          it->first, " block ", b, " from peer ", remoteID);
+            } else if (progress.blockOwner[b] != -1 && !progress.blockDone[b]) {
+                requestedElsewhere = true;
+            }
+        }
+        // nothing received and nobody else working on it, forget it so it can be picked fresh
+        if (progress.blocksDone == 0 && !requestedElsewhere) {
+            it = piecesInProgress.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    table.pipelines[table.slotOf(remoteID)].outstanding.clear();
+}
+
+// Give back the block(s) one request covered: a single block, or the whole piece for a
+// neighbor without block transfer. Caller holds requestedPiecesMutex
+void Peer::releaseBlock(int remoteID, int pieceIndex, int offset) {
+    auto it = piecesInProgress.find(pieceIndex);
+    if (it == piecesInProgress.end()) return;
+    PieceProgress& progress = it->second;
+
+    bool wholePiece = !table.has(table.slotOf(remoteID), PeerTable::BlockTransfer);
+    int target = offset / transferBlockSize();
+    bool requestedElsewhere = false;
+    for (size_t b = 0; b < progress.blockOwner.size(); b++) {
+        if (progress.blockDone[b]) continue;
+        if (progress.blockOwner[b] == remoteID && (wholePiece || (int)b == target)) {
+            progress.blockOwner[b] = -1;
+        } else if (progress.blockOwner[b] != -1) {
+            requestedElsewhere = true;
+        }
+    }
+    if (progress.blocksDone == 0 && !requestedElsewhere) piecesInProgress.erase(it);
+}
+
+// Connection gone: its pieces no longer count toward availability and its requests go back in the pool.
+// The bitfield itself stays in the table, allPeersComplete still needs it after a finished peer exits
+void Peer::handleDisconnect(int remoteID) {
+    diagInfo("Peer ", peerId, " lost connection to peer ", remoteID);
+    int slot = table.slotOf(remoteID);
+
+    // a reconnect (e.g. a restarted peer) starts choked and uninterested again, like any new neighbor
+    Bitfield remoteBitfield;
+    {
+        std::lock_guard<std::mutex> lg(neighborMutex);
+        remoteBitfield = table.bitfields[slot];
+        table.resetConnectionState(slot);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        if (table.inPicker[slot]) {
+            table.inPicker[slot] = 0;
+            picker.removePeer(remoteBitfield);
+        }
+
+        // bodies it was in the middle of sending will never finish
+        for (auto it = blocksReceiving.begin(); it != blocksReceiving.end();) {
+            it = it->second == remoteID ? blocksReceiving.erase(it) : std::next(it);
+        }
+    }
+
+    releaseRequests(remoteID);
+}
+
+//this function was pretty much done idk why there was a TODO here but mby im missing something
+void Peer::handleUnchoke(int remoteID) {
+    table.set(table.slotOf(remoteID), PeerTable::PeerChoking, false);
+    logger.logUnchoking(remoteID);
+
+    diagDebug("Peer ", peerId, " was unchoked by peer ", remoteID);
+
+    //now we can request a piece
+    requestNextPiece(remoteID);
+}
+
+void Peer::handleRequest(int remoteID, const PayloadView& payload) {
+    if (payload.size() < 4) return; // malformed
+
+    int32_t idx;
+    memcpy(&idx, payload.data(), 4);
+    idx = ntohl(idx);
+
+    // block requests also carry offset and length
+    int32_t offset = 0;
+    int32_t length = -1;
+    int slot = table.slotOf(remoteID);
+    if (table.has(slot, PeerTable::BlockTransfer) && payload.size() >= 12) {
+        memcpy(&offset, payload.data() + 4, 4);
+        memcpy(&length, payload.data() + 8, 4);
+        offset = ntohl(offset);
+        length = ntohl(length);
+    }
+
+    diagDebug("Peer ", peerId, " received REQUEST for piece ", idx, " from peer ", remoteID);
+
+    // chewck if this peer is unchoked
+    if (table.has(slot, PeerTable::AmChoking)) {
+        diagDebug("Peer ", peerId, " ignoring request from choked peer ", remoteID);
+        return;
+    }
+
+    sendPiece(remoteID, idx, offset, length);
+}
+
+// Where a PIECE body goes in the mapped file, asked by the reader as soon as the header is in.
+// nullptr (bad range, empty body, or we're a seed with a read only file) leaves it to handlePiece,
+// an empty body must not claim the block since handlePiece only releases claims that placed bytes.
+// Only one body per block streams in at a time, a duplicate could otherwise still be
+// writing after the piece completed and is being hashed
+unsigned char* Peer::pieceDestination(int remoteID, const unsigned char* header, size_t headerLen, size_t bodyLength) {
+    int32_t idx;
+    memcpy(&idx, header, 4);
+    idx = ntohl(idx);
+
+    int32_t offset = 0;
+    if (headerLen >= 8) {
+        memcpy(&offset, header + 4, 4);
+        offset = ntohl(offset);
+    }
+
+    if (bodyLength == 0 || idx < 0 || idx >= numPieces || offset < 0 ||
+        offset + (long)bodyLength > getPieceLength(idx)) {
+        return nullptr;
+    }
+    long fileOffset = (long)idx * pieceSize + offset;
+    std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+    if (hasPiece(idx) || piecesVerifying.count(idx) || blocksReceiving.count(fileOffset)) return nullptr;
+    unsigned char* dest = storage.writableRange(fileOffset, bodyLength);
+    if (dest) blocksReceiving[fileOffset] = remoteID;
+    return dest;
+}
+
+// Late or duplicate copies must not land on a piece that is being hashed or already verified
+bool Peer::pieceWritable(int pieceIndex) {
+    if (hasPiece(pieceIndex)) return false;
+    std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+    return piecesVerifying.find(pieceIndex) == piecesVerifying.end();
+}
+
+bool Peer::blockReceiving(long fileOffset) {
+    std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+    return blocksReceiving.count(fileOffset) > 0;
+}
+
+// Pick up a previous run's pieces. The resume file is trusted when the data file is exactly as it
+// left it, otherwise with metadata every piece is hashed again (which also finds pieces written
+// after the last save), and without it the saved bits still hold since a save only lists flushed pieces
+void Peer::restoreProgress(long priorSize, long long priorMtime) {
+    if (self.hasFile || resumeInterval <= 0 || priorSize != fileSize) return;
+
+    ResumeState state;
+    bool haveState = state.load(getResumeFilePath(), numPieces) &&
+                     state.fileSize == fileSize && state.pieceSize == pieceSize;
+
+    Bitfield restored;
+    const char* how;
+    if (haveState && state.fileMtime == priorMtime) {
+        restored = state.pieces;
+        how = "resume file";
+    } else if (!metadata.pieceHashes.empty()) {
+        restored = verifyExistingPieces();
+        how = "hash check";
+    } else if (haveState) {
+        restored = state.pieces;
+        how = "resume file, file changed since";
+    } else {
+        return;  // a leftover file but nothing to tell which parts of it are real
+    }
+
+    for (long i = restored.findFirst(); i >= 0; i = restored.findNext(i + 1)) {
+        bitfield.set(i);
+        picker.markHave(i);
+    }
+    piecesOwned = bitfield.count();
+    downloadComplete = piecesOwned == numPieces;
+    resumeSavedPieces = restored.count();
+    diagInfo("Peer ", peerId, " resumed with ", restored.count(), "/", numPieces, " pieces (", how, ")");
+}
+
+// Every piece of the existing file hashed on the pool at once
+Bitfield Peer::verifyExistingPieces() {
+    std::vector<char> good(numPieces, 0);
+    for (int i = 0; i < numPieces; i++) {
+        hashPool.submit([this, i, &good] { good[i] = pieceHashMatches(i); });
+    }
+    hashPool.wait();
+
+    Bitfield verified(numPieces);
+    for (int i = 0; i < numPieces; i++) {
+        if (good[i]) verified.set(i);
+    }
+    return verified;
+}
+
+// The data is flushed before its bits are written down, so the file never claims a piece that
+// isn't on disk. The mtime is taken after the flush for the next start to compare against
+void Peer::saveResumeState() {
+    ResumeState state;
+    {
+        std::lock_guard<std::mutex> lg(bitfieldMutex);
+        state.pieces = bitfield;
+    }
+    size_t owned = state.pieces.count();
+    if (owned == resumeSavedPieces) return;
+
+    storage.flush();
+    long size = 0;
+    if (!ResumeState::fileStatus(getPieceFilePath(0), size, state.fileMtime)) return;
+    state.fileSize = fileSize;
+    state.pieceSize = pieceSize;
+    if (state.save(getResumeFilePath())) resumeSavedPieces = owned;
+}
+
+// With metadata a complete piece is hashed on the pool before it counts, without it's trusted as is
+void Peer::verifyPiece(int pieceIndex, int remoteID) {
+    if (metadata.pieceHashes.empty()) {
+        finishPiece(pieceIndex, remoteID);
+        return;
+    }
+
+    hashPool.submit([this, pieceIndex, remoteID] {
+        if (!pieceHashMatches(pieceIndex)) {
+            rejectPiece(pieceIndex);
+            return;
+        }
+
+        // the bit is set first, so the piece is never both unowned and not verifying
+        finishPiece(pieceIndex, remoteID);
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        piecesVerifying.erase(pieceIndex);
+        hashFailures.erase(pieceIndex);
+    });
+}
+
+bool Peer::pieceHashMatches(int pieceIndex) {
+    long offset = (long)pieceIndex * pieceSize;
+    size_t len = getPieceLength(pieceIndex);
+
+    Sha256::Digest digest;
+    if (offset + (long)len <= storage.getMappedSize()) {
+        digest = Sha256::hash(storage.getData() + offset, len);
+    } else {
+        std::vector<unsigned char> data = loadPiece(pieceIndex);
+        if (data.empty()) return false;
+        digest = Sha256::hash(data.data(), data.size());
+    }
+    return digest == metadata.pieceHashes[pieceIndex];
+}
+
+void Peer::finishPiece(int pieceIndex, int remoteID) {
+    updateMyBitfield(pieceIndex);
+    logger.logDownloadingPiece(remoteID, pieceIndex, countPiecesOwned());
+    enterEndgameIfNeeded();
+}
 
-    // Clear any pending requests from this peer before !
+// The piece goes back to the picker and whoever sent it is only asked again if nobody else has it
+void Peer::rejectPiece(int pieceIndex) {
     {
         std::lock_guard<std::mutex> lock(requestedPiecesMutex);
-        auto it = requestedPieces.begin();
-        while (it != requestedPieces.end()) {
-            if (it->second == remoteID) {
-                std::cout << "Peer " << peerId << " clearing pending request for piece "
-                          << it->first << " from choked peer " << remoteID << std::endl;
-                it = requestedPieces.erase(it);
-            } else {
-                ++it;
-            }
+        auto it = piecesVerifying.find(pieceIndex);
+        if (it != piecesVerifying.end()) {
+            hashFailures[pieceIndex].insert(it->second.begin(), it->second.end());
+            for (int source : it->second) badPiecesFrom[source]++;
+            piecesVerifying.erase(it);
         }
     }
-}
+    diagInfo("Peer ", peerId, " piece ", pieceIndex, " failed its hash check, requesting it again");
 
-//this function was pretty much done idk why there was a TODO here but mby im missing something
-void Peer::handleUnchoke(int remoteID) {
-    neighborStates[remoteID].peerChoking = false;
-    logger.logUnchoking(remoteID);
+    for (int id : connectedNeighbors()) {
+        if (!table.has(table.slotOf(id), PeerTable::PeerChoking)) requestNextPiece(id);
+    }
+}
 
-    std::cout << "Peer " << peerId << " was unchoked by peer " << remoteID << std::endl;
+// A peer that keeps sending bad pieces is only used for what nobody else has
+bool Peer::avoidSource(int remoteID, int pieceIndex) {
+    auto bad = badPiecesFrom.find(remoteID);
+    if (bad != badPiecesFrom.end() && bad->second >= 3 && picker.availability(pieceIndex) > 1) return true;
 
-    //now we can request a piece
-    requestNextPiece(remoteID);
+    auto it = hashFailures.find(pieceIndex);
+    if (it == hashFailures.end() || it->second.count(remoteID) == 0) return false;
+    return picker.availability(pieceIndex) > (int)it->second.size();
 }
 
-void Peer::handleRequest(int remoteID, const std::vector<unsigned char>& payload) {
+// placedBytes > 0: the reader already received the body into the file and payload is only the header
+void Peer::handlePiece(int remoteID, const PayloadView& payload, size_t placedBytes) {
+    // block transfer PIECEs have the offset after the index
+    bool blockFormat = table.has(table.slotOf(remoteID), PeerTable::BlockTransfer);
+    size_t headerLen = blockFormat ? 8 : 4;
+    if (payload.size() < headerLen) return; // malformed
+
     int32_t idx;
     memcpy(&idx, payload.data(), 4);
     idx = ntohl(idx);
 
-    std::cout << "Peer " << peerId << " received REQUEST for piece " << idx << " from peer " << remoteID << std::endl;
+    int32_t offset = 0;
+    if (blockFormat) {
+        memcpy(&offset, payload.data() + 4, 4);
+        offset = ntohl(offset);
+    }
 
-    // chewck if this peer is unchoked
-    if (neighborStates[remoteID].amChoking) {
-        std::cout << "Peer " << peerId << " ignoring request from choked peer "<< remoteID << std::endl;
+    size_t length = placedBytes > 0 ? placedBytes : payload.size() - headerLen;
+    if (idx < 0 || idx >= numPieces || offset < 0 || offset + (long)length > getPieceLength(idx)) {
+        diagError("Received PIECE with invalid range from peer ", remoteID);
         return;
     }
 
-    sendPiece(remoteID, idx);
+    diagDebug("Peer ", peerId, " received piece ", idx, " offset ", offset,
+              " from peer ", remoteID, " (", length,
+              " bytes)");
+
+    // a copy arriving while another one streams into the same block is dropped, that one will finish it
+    long fileOffset = (long)idx * pieceSize + offset;
+    bool landed = placedBytes > 0;
+    if (landed) {
+        storage.commit(fileOffset, length);
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        blocksReceiving.erase(fileOffset);
+    } else if (pieceWritable(idx) && !blockReceiving(fileOffset)) {
+        savePiece(idx, payload.data() + headerLen, length, offset);
+        landed = true;
+    }
+
+    // Mark the blocks received and drop them from this neighbor's pipeline
+    bool pieceComplete = onPieceDelivered(remoteID, idx, offset, length, landed);
+    recordDownload(remoteID, length);
+
+    // endgame: whoever else we asked for this block can stop
+    if (inEndgame) cancelDuplicates(remoteID, idx, offset, pieceComplete);
+
+    if (pieceComplete) verifyPiece(idx, remoteID);
+    requestNextPiece(remoteID);
 }
 
-void Peer::handlePiece(int remoteID, const std::vector<unsigned char>& payload) {
+// The PIECE is dropped if it is still waiting in the outbound queue, once it started going out
+// there is nothing left to withdraw
+void Peer::handleCancel(int remoteID, const PayloadView& payload) {
+    if (payload.size() < 4) return; // malformed
+
     int32_t idx;
     memcpy(&idx, payload.data(), 4);
     idx = ntohl(idx);
 
-    std::vector<unsigned char> data(payload.begin() + 4, payload.end());
-
-    std::cout << "Peer " << peerId << " received piece " << idx
-              << " from peer " << remoteID << " (" << data.size()
-              << " bytes)" << std::endl;
-
-    savePiece(idx, data);
-    updateMyBitfield(idx);
-    updateDownloadRate(remoteID, data.size());
-
-    // Remove from requested map
-    {
-        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
-        requestedPieces.erase(idx);  // This works with map too so no need to refatcor
+    int32_t offset = 0;
+    if (table.has(table.slotOf(remoteID), PeerTable::BlockTransfer) && payload.size() >= 8) {
+        memcpy(&offset, payload.data() + 4, 4);
+        offset = ntohl(offset);
     }
 
-    logger.logDownloadingPiece(remoteID, idx, countPiecesOwned());
-    requestNextPiece(remoteID);
+    int sock = socketOf(remoteID);
+    if (sock < 0) return;
+    int dropped = dropQueuedPieces(sock, idx, offset);
+
+    diagDebug("Peer ", peerId, " received CANCEL for piece ", idx, " offset ", offset,
+              " from peer ", remoteID, dropped ? " (dropped queued piece)" : "");
 }
 
-void Peer::handleHave(int remoteID, const std::vector<unsigned char>& payload) {
+void Peer::handleHave(int remoteID, const PayloadView& payload) {
     if (payload.size() < 4) return; // malformed
 
     int32_t idxNet;
     memcpy(&idxNet, payload.data(), 4);
-    int pieceIndex = ntohl(idxNet);
+    applyHaves(remoteID, {(int)ntohl(idxNet)});
+}
 
-    logger.logReceivingHave(remoteID, pieceIndex);
+void Peer::handleHaveMulti(int remoteID, const PayloadView& payload) {
+    std::vector<int> pieces(payload.size() / 4);
+    for (size_t i = 0; i < pieces.size(); i++) {
+        int32_t idxNet;
+        memcpy(&idxNet, payload.data() + 4 * i, 4);
+        pieces[i] = ntohl(idxNet);
+    }
+    applyHaves(remoteID, pieces);
+}
 
-    // bounds check
-    if (pieceIndex < 0 || pieceIndex >= (int)bitfield.size()) {
-        std::cerr << "Received HAVE for invalid piece index";
-        return;
+// One or many HAVEs from a neighbor: their bitfield and the availability index are updated under
+// a single lock each, interest and completion are checked once for the lot
+void Peer::applyHaves(int remoteID, const std::vector<int>& pieces) {
+    std::vector<int> valid;
+    valid.reserve(pieces.size());
+    for (int pieceIndex : pieces) {
+        logger.logReceivingHave(remoteID, pieceIndex);
+
+        // bounds check
+        if (pieceIndex < 0 || pieceIndex >= (int)bitfield.size()) {
+            diagError("Received HAVE for invalid piece index");
+            continue;
+        }
+        valid.push_back(pieceIndex);
     }
+    if (valid.empty()) return;
 
     // update neighbor bitfield
+    int slot = table.slotOf(remoteID);
+    std::vector<int> newPieces;
     {
         std::lock_guard<std::mutex> lg(neighborMutex);
-        auto& bf = neighborBitfields[remoteID];
-        if ((int)bf.size() < (int)bitfield.size()) {
-            bf.resize(bitfield.size(), false);
+        for (int pieceIndex : valid) {
+            if (table.addPiece(slot, pieceIndex)) newPieces.push_back(pieceIndex);
+        }
+    }
+
+    // and the availability index, a HAVE before any BITFIELD starts this neighbor at zero
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        if (!table.inPicker[slot]) {
+            table.inPicker[slot] = 1;
+            std::lock_guard<std::mutex> lg(neighborMutex);
+            picker.addPeer(table.bitfields[slot]);
+        } else {
+            for (int pieceIndex : newPieces) picker.increment(pieceIndex);
         }
-        bf[pieceIndex] = true;
     }
 
-    // recalc whether we are interested
-    bool wasInterested = neighborStates[remoteID].amInterested;
-    bool isNowInterested = peerHasInterestingPieces(remoteID);
+    // recalc whether we are interested, a HAVE can only turn interest on
+    bool wasInterested = table.has(slot, PeerTable::AmInterested);
+    bool isNowInterested = wasInterested || peerHasInterestingPieces(remoteID);
 
     if (isNowInterested && !wasInterested) {
         sendInterested(remoteID);
-        neighborStates[remoteID].amInterested = true;
+        table.set(slot, PeerTable::AmInterested, true);
 
-        if (!neighborStates[remoteID].peerChoking) {
+        if (!table.has(slot, PeerTable::PeerChoking)) {
             requestNextPiece(remoteID);
         }
     }
 
     if (hasCompletedDownload() && allPeersComplete()) {
-        std::cout << "All peers have complete file. Terminating..." << std::endl;
-        running = false;
+        diagInfo("All peers have complete file. Terminating...");
+        stop();
     }
 }
 
-void Peer::handleBitfield(int remoteID, const std::vector<unsigned char> &payload) {
+void Peer::handleBitfield(int remoteID, const PayloadView& payload) {
     // Store their bitfield
-    std::vector<bool> remoteBitfield = bytesToBitfield(payload, bitfield.size());
+    Bitfield remoteBitfield = bytesToBitfield(payload, bitfield.size());
 
+    int slot = table.slotOf(remoteID);
+    Bitfield previous;
     {
         std::lock_guard<std::mutex> lg(neighborMutex);
-        neighborBitfields[remoteID] = remoteBitfield;
+        previous = table.replaceBitfield(slot, remoteBitfield);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        if (table.inPicker[slot]) picker.removePeer(previous);
+        table.inPicker[slot] = 1;
+        picker.addPeer(remoteBitfield);
     }
 
     // Check if they have anything we need
-    bool interested = false;
-    for (size_t i = 0; i < bitfield.size(); i++) {
-        if (!bitfield[i] && remoteBitfield[i]) {
-            interested = true;
-            break;
-        }
+    bool interested;
+    {
+        std::lock_guard<std::mutex> lg(bitfieldMutex);
+        interested = remoteBitfield.hasAnyNotIn(bitfield);
     }
 
-    std::cout << "Peer " << peerId << " parsed remote bitfield from "
-              << remoteID << ": ";
-    for (bool b : remoteBitfield) std::cout << b;
-    std::cout << std::endl;
+    // the bit-by-bit dump is only built when trace output is on
+    if (diagEnabled<DiagLevel::Trace>()) {
+        std::string bits(remoteBitfield.size(), '0');
+        for (size_t i = 0; i < remoteBitfield.size(); i++) {
+            if (remoteBitfield[i]) bits[i] = '1';
+        }
+        diagTrace("Peer ", peerId, " parsed remote bitfield from ", remoteID, ": ", bits);
+    }
 
     // Send interested/not interested using socket mutex
     if (interested) {
         sendInterested(remoteID);
-        neighborStates[remoteID].amInterested = true;
-        if (!neighborStates[remoteID].peerChoking) {
-            std::cout << "Peer " << peerId << " strarting requests from " << remoteID
-                      << remoteID << std::endl;
+        table.set(slot, PeerTable::AmInterested, true);
+        if (!table.has(slot, PeerTable::PeerChoking)) {
+            diagDebug("Peer ", peerId, " starting requests from ", remoteID);
             requestNextPiece(remoteID);
         }
     } else {
         sendNotInterested(remoteID);
-        neighborStates[remoteID].amInterested = false;
+        table.set(slot, PeerTable::AmInterested, false);
     }
 
     if (hasCompletedDownload() && allPeersComplete()) {
-        std::cout << "All peers have complete file. Terminating..." << std::endl;
-        running = false;
+        diagInfo("All peers have complete file. Terminating...");
+        stop();
     }
 }
 
+std::string Peer::getResumeFilePath() {
+    return getPieceFilePath(0) + ".resume";
+}
+
 std::string Peer::getPieceFilePath(int pieceIndex) {
     std::string dirPath = "../peer_" + std::to_string(peerId);
     return dirPath + "/" + fileName;  // name is from Common.cfg
 }
-void Peer::savePiece(int pieceIndex, const std::vector<unsigned char>& data) {
-    std::string filePath = getPieceFilePath(pieceIndex);
 
-    // Open file in binary mode for read/write, creates it if doesn't exist
-    std::fstream file(filePath, std::ios::binary | std::ios::in | std::ios::out);
-    if (!file.is_open()) {
-        // File doesn't exist, create it
-        file.open(filePath, std::ios::binary | std::ios::out);
-        if (!file.is_open()) {
-            std::cerr << "Error: Cannot create file " << filePath << std::endl;
-            return;
-        }
-        file.close();
-        file.open(filePath, std::ios::binary | std::ios::in | std::ios::out);
+// Last piece might be smaller
+int Peer::getPieceLength(int pieceIndex) {
+    if (pieceIndex == numPieces - 1) {
+        return fileSize - ((long)pieceIndex * pieceSize);
     }
+    return pieceSize;
+}
 
-    // Calculate offset in file
-    std::streampos offset = static_cast<std::streampos>(pieceIndex) * pieceSize;
+// Size of one REQUEST's worth of data, the whole piece unless block transfer is on
+int Peer::transferBlockSize() {
+    return blockSize > 0 ? std::min(blockSize, pieceSize) : pieceSize;
+}
 
-    // Seek to position and write
-    file.seekp(offset);
-    file.write(reinterpret_cast<const char*>(data.data()), data.size());
-    file.close();
+int Peer::blocksInPiece(int pieceIndex) {
+    int bs = transferBlockSize();
+    return (getPieceLength(pieceIndex) + bs - 1) / bs;
+}
+
+void Peer::savePiece(int pieceIndex, const unsigned char* data, size_t len, int offset) {
+    long fileOffset = (long)pieceIndex * pieceSize + offset;
+    if (!storage.write(fileOffset, data, len)) {
+        diagError("Error: Cannot write piece ", pieceIndex, " to ", getPieceFilePath(pieceIndex));
+        return;
+    }
 
-    std::cout << "Peer " << peerId << " saved piece " << pieceIndex
-              << " (" << data.size() << " bytes)" << std::endl;
+    diagTrace("Peer ", peerId, " saved piece ", pieceIndex,
+              " (", len, " bytes)");
 }
 std::vector<unsigned char> Peer::loadPiece(int pieceIndex) {
-    std::string filePath = getPieceFilePath(pieceIndex);
-
-    std::ifstream file(filePath, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Error: Cannot open file " << filePath << std::endl;
+    std::vector<unsigned char> data(getPieceLength(pieceIndex));
+    if (!storage.read((long)pieceIndex * pieceSize, data.data(), data.size())) {
+        diagError("Error: Cannot read piece ", pieceIndex, " from ", getPieceFilePath(pieceIndex));
         return {};
     }
 
-    // Calculate offset and size
-    std::streampos offset = static_cast<std::streampos>(pieceIndex) * pieceSize;
+    diagTrace("Peer ", peerId, " loaded piece ", pieceIndex,
+              " (", data.size(), " bytes)");
 
-    // Calculate piece size (last piece might be smaller)
-    int currentPieceSize = pieceSize;
-    if (pieceIndex == numPieces - 1) {
-        // Last piece
-        currentPieceSize = fileSize - (pieceIndex * pieceSize);
+    return data;
+}
+// Rarest piece that remoteID has and we neither have nor requested yet, random among equally rare ones
+int Peer::selectRarestPiece(int remoteID) {
+    // check if we have neighbor bitfield
+    int slot = table.slotOf(remoteID);
+    int selectedPiece;
+    {
+        // a BITFIELD on another connection swaps bitfields[slot] under neighborMutex
+        std::lock_guard<std::mutex> lg(neighborMutex);
+        if (!table.heardFrom[slot]) {
+            return -1;  // Don't know what they have
+        }
+        const Bitfield& remoteBitfield = table.bitfields[slot];
+
+        // the picker only holds pieces we don't have
+        selectedPiece = picker.pickRarest([&](int i) {
+            return remoteBitfield[i] && piecesInProgress.find(i) == piecesInProgress.end() &&
+                   piecesVerifying.find(i) == piecesVerifying.end() && !avoidSource(remoteID, i);
+        }, pickRng);
     }
 
-    // Seek and read
-    file.seekg(offset);
-    std::vector<unsigned char> data(currentPieceSize);
-    file.read(reinterpret_cast<char*>(data.data()), currentPieceSize);
-    file.close();
+    if (selectedPiece == -1) {
+        return -1;
+    }
 
-    std::cout << "Peer " << peerId << " loaded piece " << pieceIndex
-              << " (" << data.size() << " bytes)" << std::endl;
+    // start tracking its blocks, the caller claims them
+    PieceProgress& progress = piecesInProgress[selectedPiece];
+    int nBlocks = blocksInPiece(selectedPiece);
+    progress.blockOwner.assign(nBlocks, -1);
+    progress.blockDone.assign(nBlocks, false);
 
-    return data;
+    diagDebug("Peer ", peerId, " selected piece ", selectedPiece,
+              " (held by ", picker.availability(selectedPiece), " neighbors)",
+              " from peer ", remoteID);
+
+    return selectedPiece;
 }
-int Peer::selectRandomPiece(int remoteID) {
-    // check if we have neighbor bitfield
-    if (neighborBitfields.find(remoteID) == neighborBitfields.end()) {
-        return -1;  // Don't know what they have
+
+int Peer::countPiecesOwned() {
+    return piecesOwned;
+}
+
+bool Peer::hasCompletedDownload() {
+    return downloadComplete;
+}
+void Peer::requestNextPiece(int remoteID) {
+    // Check if we're choked
+    int slot = table.slotOf(remoteID);
+    if (table.has(slot, PeerTable::PeerChoking)) {
+        diagDebug("Peer ", peerId, " is choked by peer ", remoteID,
+                  ", cannot request");
+        return;
+    }
+
+    bool blockFormat = table.has(slot, PeerTable::BlockTransfer);
+    int sock = socketOf(remoteID);
+    int inFlight;
+    int depth;
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        RequestPipeline& pipeline = table.pipelines[slot];
+        inFlight = pipeline.outstanding.size();
+        depth = pipelineDepth(pipeline, blockFormat ? transferBlockSize() : pieceSize);
+    }
+
+    // top the pipeline up to its depth
+    int requested = 0;
+    while (inFlight + requested < depth) {
+        int pieceIndex, offset, length;
+        if (!claimNextRequest(remoteID, pieceIndex, offset, length)) break;
+
+        // Create REQUEST message payload (4-byte piece index ad per the pdf, then offset + length for blocks)
+        std::vector<unsigned char> payload(blockFormat ? 12 : 4);
+        int32_t idxNet = htonl(pieceIndex);
+        //I hate c++
+        memcpy(payload.data(), &idxNet, 4);
+        if (blockFormat) {
+            int32_t offsetNet = htonl(offset);
+            int32_t lengthNet = htonl(length);
+            memcpy(payload.data() + 4, &offsetNet, 4);
+            memcpy(payload.data() + 8, &lengthNet, 4);
+        }
+
+        // Send request message = type 6
+        sendMessage(sock, 6, payload);
+        requested++;
+
+        diagDebug("Peer ", peerId, " requested piece ", pieceIndex, " offset ", offset,
+                  " from peer ", remoteID, " (", inFlight + requested,
+                  "/", depth, " in flight)");
     }
 
-    std::vector<bool>& remoteBitfield = neighborBitfields[remoteID];
+    // nothing to ask for right now can just mean the rest is in flight elsewhere or still being
+    // hashed, only lose interest once they really have nothing we lack
+    if (requested == 0 && inFlight == 0 && !peerHasInterestingPieces(remoteID)) {
+        diagDebug("Peer ", peerId, " has no pieces to request from peer ",
+                  remoteID);
+
+        if (table.has(slot, PeerTable::AmInterested)) {
+            sendMessage(sock, 3, {});  // type 3 = not interested
+            table.set(slot, PeerTable::AmInterested, false);
+        }
+    }
+}
 
-    // Find pieces that:
-    // 1. remote peer has
-    // 2. We don't have
-    // 3. we haven't requested yet
-    std::vector<int> availablePieces;
+// Pick what to ask remoteID for next and mark it requested. Block capable neighbors first help
+// finish pieces other peers already started, so one slow neighbor can't hold a piece hostage;
+// otherwise a fresh piece is picked and claimed whole (legacy) or from its first block
+bool Peer::claimNextRequest(int remoteID, int& pieceIndex, int& offset, int& length) {
+    int slot = table.slotOf(remoteID);
+    bool blockFormat = table.has(slot, PeerTable::BlockTransfer);
+    int bs = transferBlockSize();
 
     std::lock_guard<std::mutex> lock(requestedPiecesMutex);
 
-    for (size_t i = 0; i < bitfield.size(); i++) {
-        if (!bitfield[i] &&                           // We don't have it
-            remoteBitfield[i] &&                      // They have it
-            requestedPieces.find(i) == requestedPieces.end()) // Not requested
-        {
-            availablePieces.push_back(i);
+    bool claimed = false;
+    if (blockFormat) {
+        std::lock_guard<std::mutex> lg1(bitfieldMutex);
+        std::lock_guard<std::mutex> lg2(neighborMutex);
+        const Bitfield& remoteBitfield = table.bitfields[slot];
+        bool known = table.heardFrom[slot];
+        for (auto it = piecesInProgress.begin(); known && !claimed && it != piecesInProgress.end(); ++it) {
+            int idx = it->first;
+            if (bitfield[idx] || !remoteBitfield[idx] || avoidSource(remoteID, idx)) continue;
+
+            PieceProgress& progress = it->second;
+            for (size_t b = 0; b < progress.blockOwner.size(); b++) {
+                if (progress.blockOwner[b] != -1 || progress.blockDone[b]) continue;
+
+                progress.blockOwner[b] = remoteID;
+                pieceIndex = idx;
+                offset = b * bs;
+                length = std::min(bs, getPieceLength(idx) - offset);
+                claimed = true;
+                break;
+            }
         }
     }
+    if (claimed) {
+        trackRequest(remoteID, pieceIndex, offset);
+        return true;
+    }
 
-    if (availablePieces.empty()) {
-        return -1;
+    pieceIndex = selectRarestPiece(remoteID);
+    if (pieceIndex == -1) {
+        return inEndgame && claimEndgameRequest(remoteID, pieceIndex, offset, length);
     }
 
-    // Random selection
-    int randomIndex = rand() % availablePieces.size();
-        int selectedPiece = availablePieces[randomIndex];
+    PieceProgress& progress = piecesInProgress[pieceIndex];
+    offset = 0;
+    if (blockFormat) {
+        progress.blockOwner[0] = remoteID;
+        length = std::min(bs, getPieceLength(pieceIndex));
+    } else {
+        std::fill(progress.blockOwner.begin(), progress.blockOwner.end(), remoteID);
+        length = getPieceLength(pieceIndex);
+    }
+    trackRequest(remoteID, pieceIndex, offset);
+    return true;
+}
 
-    // mark as requested with the peer ID
-    requestedPieces[selectedPiece] = remoteID;
+// Endgame: everything left is already requested, so ask remoteID for blocks it has that are
+// still missing even though another neighbor is fetching them. Caller holds requestedPiecesMutex
+bool Peer::claimEndgameRequest(int remoteID, int& pieceIndex, int& offset, int& length) {
+    int slot = table.slotOf(remoteID);
+    bool blockFormat = table.has(slot, PeerTable::BlockTransfer);
+    int bs = transferBlockSize();
+    RequestPipeline& pipeline = table.pipelines[slot];
 
-    std::cout << "Peer " << peerId << " selected piece " << selectedPiece
-              << " from peer " << remoteID << std::endl;
+    bool claimed = false;
+    {
+        std::lock_guard<std::mutex> lg1(bitfieldMutex);
+        std::lock_guard<std::mutex> lg2(neighborMutex);
+        if (!table.heardFrom[slot]) return false;
+        const Bitfield& remoteBitfield = table.bitfields[slot];
+
+        for (auto& [idx, progress] : piecesInProgress) {
+            if (bitfield[idx] || !remoteBitfield[idx]) continue;
+
+            if (!blockFormat) {
+                // whole piece neighbors can only duplicate the whole thing
+                if (pipeline.outstanding.count({idx, 0})) continue;
+                pieceIndex = idx;
+                offset = 0;
+                length = getPieceLength(idx);
+            } else {
+                size_t b = 0;
+                for (; b < progress.blockDone.size(); b++) {
+                    if (!progress.blockDone[b] && !pipeline.outstanding.count({idx, (int)b * bs})) break;
+                }
+                if (b == progress.blockDone.size()) continue;
+                pieceIndex = idx;
+                offset = b * bs;
+                length = std::min(bs, getPieceLength(idx) - offset);
+            }
+            claimed = true;
+            break;
+        }
+    }
+    if (!claimed) return false;
 
-    return selectedPiece;
+    trackRequest(remoteID, pieceIndex, offset);
+    diagDebug("Peer ", peerId, " endgame duplicate request for piece ", pieceIndex,
+              " offset ", offset, " to peer ", remoteID);
+    return true;
 }
 
-int Peer::countPiecesOwned() {
-    int count = 0;
-    for (bool hasPiece : bitfield) {
-        if (hasPiece) count++;
+// Switch to endgame once few enough pieces remain and get every unchoked neighbor requesting
+void Peer::enterEndgameIfNeeded() {
+    if (endgameThreshold <= 0 || inEndgame) return;
+
+    int remaining;
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        remaining = picker.remaining();
     }
-    return count;
-}
+    if (remaining == 0 || remaining > endgameThreshold) return;
+    if (inEndgame.exchange(true)) return;
 
-bool Peer::hasCompletedDownload() {
-    for (bool hasPiece : bitfield) {
-        if (!hasPiece) return false;
+    diagInfo("Peer ", peerId, " entering endgame with ", remaining, " pieces left");
+
+    for (int remoteID : connectedNeighbors()) {
+        if (!table.has(table.slotOf(remoteID), PeerTable::PeerChoking)) requestNextPiece(remoteID);
     }
-    logger.logDownloadComplete();
-    return true;
 }
-void Peer::requestNextPiece(int remoteID) {
-    // Check if we're choked
-    if (neighborStates[remoteID].peerChoking) {
-        std::cout << "Peer " << peerId << " is choked by peer " << remoteID
-                  << ", cannot request" << std::endl;
-        return;
-    }
 
-    // random
-    int pieceIndex = selectRandomPiece(remoteID);
+// A block arrived from remoteID: withdraw the same request from every other neighbor
+void Peer::cancelDuplicates(int remoteID, int pieceIndex, int offset, bool pieceComplete) {
+    int bs = transferBlockSize();
+    std::vector<std::pair<int, int>> cancels;  // slot, offset
+    int from = table.slotOf(remoteID);
 
-    if (pieceIndex == -1) {
-        std::cout << "Peer " << peerId << " has no pieces to request from peer "
-                  << remoteID << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        for (int slot = 0; slot < table.size(); slot++) {
+            RequestPipeline& pipeline = table.pipelines[slot];
+            if (slot == from || pipeline.outstanding.empty()) continue;
+            auto it = pipeline.outstanding.lower_bound({pieceIndex, 0});
+            while (it != pipeline.outstanding.end() && it->first.first == pieceIndex) {
+                // a finished piece cancels everything, otherwise only the same block
+                if (pieceComplete || it->first.second == offset) {
+                    cancels.push_back({slot, it->first.second});
+                    it = pipeline.outstanding.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
 
-        // Send not interested
-        sendMessage(peerSockets[remoteID], 3, {});  // type 3 = not interested
-        return;
+    for (auto& [slot, off] : cancels) {
+        int length = table.has(slot, PeerTable::BlockTransfer) ? std::min(bs, getPieceLength(pieceIndex) - off)
+                                                               : getPieceLength(pieceIndex);
+        sendCancel(table.ids[slot], pieceIndex, off, length);
     }
+}
 
-    // Create REQUEST message payload (4-byte piece index ad per the pdf)
-    std::vector<unsigned char> payload(4);
+// CANCEL (type 8) mirrors the REQUEST it withdraws
+void Peer::sendCancel(int remoteID, int pieceIndex, int offset, int length) {
+    bool blockFormat = table.has(table.slotOf(remoteID), PeerTable::BlockTransfer);
+    std::vector<unsigned char> payload(blockFormat ? 12 : 4);
     int32_t idxNet = htonl(pieceIndex);
-    //I hate c++
     memcpy(payload.data(), &idxNet, 4);
+    if (blockFormat) {
+        int32_t offsetNet = htonl(offset);
+        int32_t lengthNet = htonl(length);
+        memcpy(payload.data() + 4, &offsetNet, 4);
+        memcpy(payload.data() + 8, &lengthNet, 4);
+    }
 
-    // Send request message = type 6
-    sendMessage(peerSockets[remoteID], 6, payload);
+    int sock = socketOf(remoteID);
+    if (sock < 0) return;
+    sendMessage(sock, 8, payload);
 
-    std::cout << "Peer " << peerId << " requested piece " << pieceIndex
-              << " from peer " << remoteID << std::endl;
+    diagDebug("Peer ", peerId, " sent CANCEL for piece ", pieceIndex,
+              " offset ", offset, " to peer ", remoteID);
+}
 
+// Record a request as in flight and arm its deadline. Caller holds requestedPiecesMutex
+void Peer::trackRequest(int remoteID, int pieceIndex, int offset) {
+    auto sent = now();
+    table.pipelines[table.slotOf(remoteID)].outstanding[{pieceIndex, offset}] = sent;
+    if (requestTimeout > 0) {
+        requestDeadlines.push({sent + std::chrono::seconds(requestTimeout), remoteID, pieceIndex, offset});
+        armRequestTimer();
+    }
 }
-void Peer::sendPiece(int remoteID, int pieceIndex) {
-        // check if we have this piece in the first place
-    if (!bitfield[pieceIndex]) {
-        std::cerr << "Error: Peer " << peerId << " doesn't have piece " << pieceIndex << std::endl;
-        return;
+
+// One timer on the earliest deadline, moved up when an earlier one shows up. A timer that was
+// overtaken still fires, finds nothing due and leaves the newer one armed
+void Peer::armRequestTimer() {
+    if (requestDeadlines.empty()) return;
+    auto when = std::max(requestDeadlines.top().when, now() + REQUEST_CHECK_SPACING);
+    if (requestTimerArmed && requestTimerAt <= when) return;
+
+    requestTimerArmed = true;
+    requestTimerAt = when;
+    timers.at(when, [this, when] {
+        {
+            std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+            if (requestTimerAt == when) requestTimerArmed = false;
+        }
+        checkRequestTimeouts();
+    });
+}
+
+// Expire requests nobody answered in time. A neighbor that is still delivering earlier requests
+// isn't stalled, it's just deep in its pipeline, so the deadline is pushed out from its last
+// delivery. A real timeout releases the block for other neighbors and marks the peer snubbed
+void Peer::checkRequestTimeouts() {
+    auto now = this->now();
+    auto timeout = std::chrono::seconds(requestTimeout);
+    std::set<int> stalled;
+
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        while (!requestDeadlines.empty() && requestDeadlines.top().when <= now) {
+            RequestDeadline deadline = requestDeadlines.top();
+            requestDeadlines.pop();
+
+            RequestPipeline& pipeline = table.pipelines[table.slotOf(deadline.peerID)];
+            auto it = pipeline.outstanding.find({deadline.pieceIndex, deadline.offset});
+            if (it == pipeline.outstanding.end()) continue;  // answered, cancelled or cleared
+
+            if (pipeline.lastDelivery > it->second && now - pipeline.lastDelivery < timeout) {
+                requestDeadlines.push({pipeline.lastDelivery + timeout, deadline.peerID,
+                                       deadline.pieceIndex, deadline.offset});
+                continue;
+            }
+
+            diagInfo("Peer ", peerId, " request for piece ", deadline.pieceIndex,
+                     " offset ", deadline.offset, " to peer ", deadline.peerID,
+                     " timed out");
+
+            pipeline.outstanding.erase(it);
+            pipeline.snubbed = true;
+            releaseBlock(deadline.peerID, deadline.pieceIndex, deadline.offset);
+            stalled.insert(deadline.peerID);
+        }
+        armRequestTimer();
     }
 
-    // Load
-    std::vector<unsigned char> pieceData = loadPiece(pieceIndex);
+    if (stalled.empty()) return;
 
-    if (pieceData.empty()) {
-        std::cerr << "Error: Failed to load piece " << pieceIndex << std::endl;
-        return;
+    // hand the released blocks to everyone else that is unchoking us
+    for (int remoteID : connectedNeighbors()) {
+        if (!stalled.count(remoteID) && !table.has(table.slotOf(remoteID), PeerTable::PeerChoking)) {
+            requestNextPiece(remoteID);
+        }
     }
+}
 
-    // Create piece message payload: 4-byte index + piece data
-    std::vector<unsigned char> payload(4 + pieceData.size());
-    int32_t idxNet = htonl(pieceIndex);
-    memcpy(payload.data(), &idxNet, 4);
-    memcpy(payload.data() + 4, pieceData.data(), pieceData.size());
+// How many REQUESTs to keep in flight. Auto mode aims for one bandwidth-delay product worth of
+// requests plus one, so the pipe never drains while a request is on the wire; it starts at 2
+// and grows as the measured delivery rate rises. Caller holds requestedPiecesMutex
+int Peer::pipelineDepth(const RequestPipeline& pipeline, int requestBytes) {
+    if (pipeline.snubbed) return 1;  // just enough to notice when it wakes up
+    if (requestPipelineDepth > 0) return requestPipelineDepth;
+    if (pipeline.minRtt <= 0.0 || pipeline.deliveryRate <= 0.0) return 2;
+
+    double bdpRequests = pipeline.deliveryRate * pipeline.minRtt / requestBytes;
+    return std::clamp((int)std::ceil(bdpRequests) + 1, 2, MAX_PIPELINE_DEPTH);
+}
+
+// Record a received range, returns true when it completed the piece
+// landed false: the bytes were dropped, only the request is cleared
+bool Peer::onPieceDelivered(int remoteID, int pieceIndex, int offset, size_t bytes, bool landed) {
+    auto now = this->now();
+    int bs = transferBlockSize();
+
+    std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+
+    bool pieceComplete = false;
+    if (landed && !hasPiece(pieceIndex) && piecesVerifying.find(pieceIndex) == piecesVerifying.end()) {
+        // late arrivals (after a CHOKE cleared the entry) still count
+        PieceProgress& progress = piecesInProgress[pieceIndex];
+        if (progress.blockDone.empty()) {
+            int nBlocks = blocksInPiece(pieceIndex);
+            progress.blockOwner.assign(nBlocks, -1);
+            progress.blockDone.assign(nBlocks, false);
+        }
 
-    // Send PIECE message (type 7)
-    sendMessage(peerSockets[remoteID], 7, payload);
+        // only whole blocks count, a peer using another block size just fills what it covers
+        int first = (offset + bs - 1) / bs;
+        long end = offset + (long)bytes;
+        for (int b = first; b < (int)progress.blockDone.size(); b++) {
+            long blockEnd = std::min<long>((long)(b + 1) * bs, getPieceLength(pieceIndex));
+            if (blockEnd > end) break;
+            if (!progress.blockDone[b]) {
+                progress.blockDone[b] = true;
+                progress.blocksDone++;
+            }
+        }
+
+        progress.sources.insert(remoteID);
+        if (progress.blocksDone == (int)progress.blockDone.size()) {
+            // held back from the picker until the hash check says yes or no
+            if (!metadata.pieceHashes.empty()) piecesVerifying[pieceIndex] = std::move(progress.sources);
+            piecesInProgress.erase(pieceIndex);
+            pieceComplete = true;
+        }
+    }
+
+    RequestPipeline& pipeline = table.pipelines[table.slotOf(remoteID)];
+    auto it = pipeline.outstanding.find({pieceIndex, offset});
+    if (it == pipeline.outstanding.end()) return pieceComplete;  // unsolicited or cleared by a CHOKE
 
-    std::cout << "Peer " << peerId << " sent piece " << pieceIndex
-              << " to peer " << remoteID << " (" << pieceData.size()
-              << " bytes)" << std::endl;
-    //more debuging
+    double rtt = std::chrono::duration<double>(now - it->second).count();
+    if (pipeline.minRtt <= 0.0 || rtt < pipeline.minRtt) pipeline.minRtt = rtt;
+
+    // delivery rate from inter-arrival time, only while the pipe was busy
+    if (pipeline.lastDelivery.time_since_epoch().count() != 0 && pipeline.outstanding.size() > 1) {
+        double gap = std::chrono::duration<double>(now - pipeline.lastDelivery).count();
+        if (gap > 0.0) {
+            double sample = bytes / gap;
+            pipeline.deliveryRate = pipeline.deliveryRate <= 0.0 ? sample
+                                  : 0.8 * pipeline.deliveryRate + 0.2 * sample;
+        }
+    } else if (pipeline.deliveryRate <= 0.0) {
+        pipeline.deliveryRate = bytes / std::max(rtt, 1e-6);
+    }
+    pipeline.lastDelivery = now;
+    pipeline.snubbed = false;
+    pipeline.outstanding.erase(it);
+    return pieceComplete;
 }
+// length -1 sends the whole piece; block transfer neighbors get the offset echoed back in the header
+void Peer::sendPiece(int remoteID, int pieceIndex, int offset, int length) {
+    // check if we have this piece in the first place
+    if (pieceIndex < 0 || pieceIndex >= numPieces || !hasPiece(pieceIndex)) {
+        diagError("Error: Peer ", peerId, " doesn't have piece ", pieceIndex);
+        return;
+    }
+
+    int currentPieceSize = getPieceLength(pieceIndex);
+    if (length < 0) length = currentPieceSize - offset;
+    if (offset < 0 || length <= 0 || offset + length > currentPieceSize) {
+        diagError("Error: Peer ", peerId, " got a bad range for piece ", pieceIndex);
+        return;
+    }
 
-void Peer::broadcastHave(int pieceIndex) {
-    if (pieceIndex < 0 || pieceIndex >= (int)bitfield.size())
+    if (!storage.isOpen()) {
+        diagError("Error: Failed to load piece ", pieceIndex);
         return;
+    }
+
+    int sock = socketOf(remoteID);
+    if (sock < 0) return;
 
-    std::vector<unsigned char> payload(4);
+    // PIECE message (type 7): length, type, 4-byte index, [4-byte offset], then the bytes straight from the file
+    bool blockFormat = table.has(table.slotOf(remoteID), PeerTable::BlockTransfer);
+    size_t headerLen = blockFormat ? 13 : 9;
+    OutboundFrame frame;
+    frame.bytes.resize(headerLen);
+    uint32_t lenNet = htonl(1 + (headerLen - 5) + length);
     int32_t idxNet = htonl(pieceIndex);
-    memcpy(payload.data(), &idxNet, 4);
+    int32_t offsetNet = htonl(offset);
+    memcpy(frame.bytes.data(), &lenNet, 4);
+    frame.bytes[4] = 7;
+    memcpy(frame.bytes.data() + 5, &idxNet, 4);
+    if (blockFormat) memcpy(frame.bytes.data() + 9, &offsetNet, 4);
+    frame.bodyOffset = (off_t)pieceIndex * pieceSize + offset;
+    frame.bodyLength = length;
+    frame.pieceIndex = pieceIndex;
+    frame.offset = offset;
+
+    if (!queueFrame(sock, std::move(frame), true)) return;
+
+    diagDebug("Peer ", peerId, " queued piece ", pieceIndex, " offset ", offset,
+              " for peer ", remoteID, " (", length,
+              " bytes)");
+}
 
-    std::vector<int> sockets;
+// Neighbors that understand HAVE_MULTI get the whole batch in as few frames as fit, the rest one
+// HAVE per piece. Either way the control frames for a socket go out in a single write
+void Peer::broadcastHaves(const std::vector<int>& pieces) {
+    if (pieces.empty()) return;
 
+    std::vector<std::pair<int, int>> targets;  // (slot, socket)
     {
         std::lock_guard<std::mutex> lg(socketMutex);
-        for (auto& [remotePeerID, socket] : peerSockets) {
-            sockets.push_back(socket);
+        for (int slot = 0; slot < table.size(); slot++) {
+            if (table.sockets[slot] >= 0) targets.push_back({slot, table.sockets[slot]});
         }
     }
 
-    for (int sock : sockets) {
-        sendMessage(sock, 4, payload);
+    std::vector<std::vector<unsigned char>> single(pieces.size(), std::vector<unsigned char>(4));
+    for (size_t i = 0; i < pieces.size(); i++) {
+        int32_t idxNet = htonl(pieces[i]);
+        memcpy(single[i].data(), &idxNet, 4);
     }
 
+    // keep each HAVE_MULTI under the receiver's frame limit
+    size_t perFrame = std::max<size_t>(pieceSize, bitfield.byteSize()) / 4;
+    std::vector<std::vector<unsigned char>> multi;
+    for (size_t start = 0; pieces.size() > 1 && start < pieces.size(); start += perFrame) {
+        size_t end = std::min(pieces.size(), start + perFrame);
+        std::vector<unsigned char> payload;
+        payload.reserve(4 * (end - start));
+        for (size_t i = start; i < end; i++) payload.insert(payload.end(), single[i].begin(), single[i].end());
+        multi.push_back(std::move(payload));
+    }
 
-    //logger.logBroadcastHave("Peer " + std::to_string(peerId) +
-    //           " broadcasted HAVE for piece " + std::to_string(pieceIndex));
+    for (auto& [slot, sock] : targets) {
+        if (!multi.empty() && table.has(slot, PeerTable::MultiHave)) {
+            for (auto& payload : multi) sendMessage(sock, MSG_HAVE_MULTI, payload);
+        } else {
+            for (auto& payload : single) sendMessage(sock, 4, payload);
+        }
+    }
 }
 
-
-// convert my vector<bool> bitfield to bytes for message payload
+// convert my bitfield to bytes for message payload
 std::vector<unsigned char> Peer::bitfieldToBytes() {
     std::lock_guard<std::mutex> lg(bitfieldMutex);
-    int nbits = (int)bitfield.size();
-    int nbytes = (nbits + 7) / 8;
-    std::vector<unsigned char> out(nbytes, 0);
+    return bitfield.toBytes();  // highest bit = piece index 0 in each byte
+}
 
-    for (int i = 0; i < nbits; ++i) {
-        if (bitfield[i]) {
-            int byteIndex = i / 8;
-            int bitIndex = 7 - (i % 8); // highest bit = piece index 0 in that byte
-            out[byteIndex] |= (1 << bitIndex);
-        }
-    }
-    return out;
+// parse byte payload into a bitfield with expectedBits length
+Bitfield Peer::bytesToBitfield(const PayloadView& payload, int expectedBits) {
+    return Bitfield::fromBytes(payload.data(), payload.size(), expectedBits);
 }
 
-// parse byte payload into vector<bool> with expectedBits length
-std::vector<bool> Peer::bytesToBitfield(const std::vector<unsigned char>& payload, int expectedBits) {
-    std::vector<bool> out(expectedBits, false);
-    int nbytes = payload.size();
-    for (int b = 0; b < nbytes; ++b) {
-        unsigned char byte = payload[b];
-        for (int bit = 0; bit < 8; ++bit) {
-            int pieceIndex = b * 8 + bit;
-            if (pieceIndex >= expectedBits) break;
-            int bitPos = 7 - bit; // map high->low to indices
-            out[pieceIndex] = ((byte >> bitPos) & 0x1);
-        }
-    }
-    return out;
+bool Peer::hasPiece(int pieceIndex) {
+    std::lock_guard<std::mutex> lg(bitfieldMutex);
+    return bitfield[pieceIndex];
 }
 
 bool Peer::peerHasInterestingPieces(int remoteID) {
+    if (downloadComplete) return false;  // seeds see every HAVE, no need to scan for them
     std::lock_guard<std::mutex> lg1(bitfieldMutex);
     std::lock_guard<std::mutex> lg2(neighborMutex);
 
-    auto it = neighborBitfields.find(remoteID);
-    if (it == neighborBitfields.end()) return false;
+    int slot = table.slotOf(remoteID);
+    if (!table.heardFrom[slot]) return false;
 
-    const std::vector<bool>& neighborBF = it->second;
-    int n = std::min((int)bitfield.size(), (int)neighborBF.size());
-    for (int i = 0; i < n; ++i) {
-        if (neighborBF[i] && !bitfield[i]) return true; // they have something I don't
-    }
-    return false;
+    return table.bitfields[slot].hasAnyNotIn(bitfield); // they have something I don't
 }
 
 void Peer::updateMyBitfield(int pieceIndex) {
+    bool complete;
+    bool batchStarts;
     {
         std::lock_guard<std::mutex> lg(bitfieldMutex);
         if (pieceIndex < 0 || pieceIndex >= (int)bitfield.size()) return;
         if (bitfield[pieceIndex]) return; // already set
-        bitfield[pieceIndex] = true;
+        bitfield.set(pieceIndex);
+        batchStarts = pendingHaves.empty();
+        pendingHaves.push_back(pieceIndex);
+        // only one caller gets here with the last piece, so completion fires once
+        complete = ++piecesOwned == numPieces;
+        if (complete) downloadComplete = true;
     }
 
-    std::cout << "Peer " << peerId << " completed piece " << pieceIndex
-              << " (" << countPiecesOwned() << "/" << numPieces << ")" << std::endl;
-
-    broadcastHave(pieceIndex);
-
-    std::vector<int> peerIDs;
     {
-        std::lock_guard<std::mutex> lg(socketMutex);
-        for (auto& [id, sock] : peerSockets) {
-            peerIDs.push_back(id);
-        }
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        picker.markHave(pieceIndex);
     }
 
-    for (int remoteID : peerIDs) {
-        bool wasInterested = neighborStates[remoteID].amInterested;
-        bool isInteresting = peerHasInterestingPieces(remoteID);
+    diagDebug("Peer ", peerId, " completed piece ", pieceIndex,
+              " (", countPiecesOwned(), "/", numPieces, ")");
 
-        if (!isInteresting && wasInterested) {
-            sendNotInterested(remoteID);
-            neighborStates[remoteID].amInterested = false;
-            std::cout << "Peer " << peerId << " no longer interested in "
-                      << remoteID << std::endl;
-        }
+    // the last piece goes out right away, everyone waits on it to finish
+    if (haveBatchInterval <= 0 || complete) {
+        flushHaves();
+    } else if (batchStarts) {
+        timers.at(now() + std::chrono::milliseconds(haveBatchInterval), [this] { flushHaves(); });
     }
 
     // Check download completion
-    if (hasCompletedDownload()) {
-        std::cout << "Peer " << peerId << " has downloaded the complete file!"
-                  << std::endl;
+    if (complete) {
+        logger.logDownloadComplete();
+        diagInfo("Peer ", peerId, " has downloaded the complete file!");
 
         if (allPeersComplete()) {
-            std::cout << "All peers have complete file. Terminating..." << std::endl;
-            running = false;
+            diagInfo("All peers have complete file. Terminating...");
+            stop();
         }
     }
 }
 
-void Peer::sendInterested(int remoteID) {
-    int sock = -1;
+void Peer::flushHaves() {
+    std::vector<int> pieces;
     {
-        std::lock_guard<std::mutex> lg(socketMutex);
-        auto it = peerSockets.find(remoteID);
-        if (it == peerSockets.end()) return;
-        sock = it->second;
+        std::lock_guard<std::mutex> lg(bitfieldMutex);
+        pieces.swap(pendingHaves);
     }
+    if (pieces.empty()) return;
+
+    broadcastHaves(pieces);
+
+    for (int remoteID : connectedNeighbors()) {
+        // our new pieces can only turn interest off
+        int slot = table.slotOf(remoteID);
+        if (!table.has(slot, PeerTable::AmInterested)) continue;
+
+        if (!peerHasInterestingPieces(remoteID)) {
+            sendNotInterested(remoteID);
+            table.set(slot, PeerTable::AmInterested, false);
+            diagDebug("Peer ", peerId, " no longer interested in ",
+                      remoteID);
+        }
+    }
+}
+
+void Peer::sendInterested(int remoteID) {
+    int sock = socketOf(remoteID);
+    if (sock < 0) return;
     sendMessage(sock, 2, {}); // type 2 == interested
 
 
     //logger.log("Peer " + std::to_string(peerId) + " sent 'interested' to " + std::to_string(remoteID));
     logger.logReceivingInterested(remoteID);
-    std::cout << "sent interested" << std::endl;
+    diagDebug("sent interested");
 }
 
 void Peer::sendNotInterested(int remoteID) {
-    int sock = -1;
-    {
-        std::lock_guard<std::mutex> lg(socketMutex);
-        auto it = peerSockets.find(remoteID);
-        if (it == peerSockets.end()) return;
-        sock = it->second;
-    }
+    int sock = socketOf(remoteID);
+    if (sock < 0) return;
     sendMessage(sock, 3, {}); // type 3 == not interested
 
     //logger.log("Peer " + std::to_string(peerId) + " sent 'not interested' to " + std::to_string(remoteID));
     logger.logReceivingNotInterested(remoteID);
-    std::cout << "sent not interested" << std::endl;
+    diagDebug("sent not interested");
 }
 
-ssize_t Peer::readNBytes(int sock, void* buffer, size_t n) {
-    size_t total = 0;
-    char* ptr = (char*)buffer;
-    while (total < n) {
-        ssize_t r = recv(sock, ptr + total, n - total, 0);
-        if (r <= 0) return r; // error or closed
-        total += r;
-    }
-    return total;
-}
 // choke/unchoke - esha
 void Peer::selectPreferredNeighbors() {
+    // neighbors sitting on our requests don't earn a preferred slot, they can still win the optimistic one.
+    // Collected first: requestedPiecesMutex is never taken while holding neighborMutex
+    std::vector<char> snubbed(table.size(), 0);
+    {
+        std::lock_guard<std::mutex> lock(requestedPiecesMutex);
+        for (int slot = 0; slot < table.size(); slot++) snubbed[slot] = table.pipelines[slot].snubbed;
+    }
+
     std::lock_guard<std::mutex> lock(neighborMutex);
 
-    std::vector<std::pair<int, double>> candidates;
+    // leeching we reward whoever sends us the most, seeding whoever takes our uploads fastest
+    std::vector<std::pair<int, double>> candidates;  // (slot, rate)
+    bool seeding = hasCompletedDownload();
+    auto now = this->now();
 
-    for (auto& [peerID, state] : neighborStates) {
-        if (state.peerInterested) {
-            candidates.push_back({peerID, state.downloadRate});
+    for (int slot = 0; slot < table.size(); slot++) {
+        if (table.has(slot, PeerTable::PeerInterested) && (seeding || !snubbed[slot])) {
+            double rate = seeding ? table.uploaded[slot].rate(now) : table.downloaded[slot].rate(now);
+            candidates.push_back({slot, rate});
         }
     }
 
-    if (hasCompletedDownload()) {
-        std::random_shuffle(candidates.begin(), candidates.end());
-    } else {
-        std::sort(candidates.begin(), candidates.end(),
-                  [](const auto& a, const auto& b) { return a.second > b.second; });
-    }
+    // shuffled first so equal rates (everyone at zero early on) come out in random order
+    std::shuffle(candidates.begin(), candidates.end(), chokeRng);
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const auto& a, const auto& b) { return a.second > b.second; });
 
     std::vector<int> newPreferredNeighbors;
+    std::vector<char> preferred(table.size(), 0);
     int count = std::min((int)candidates.size(), numPreferredNeighbors);
     for (int i = 0; i < count; i++) {
-        newPreferredNeighbors.push_back(candidates[i].first);
+        newPreferredNeighbors.push_back(table.ids[candidates[i].first]);
+        preferred[candidates[i].first] = 1;
     }
 
     if (!newPreferredNeighbors.empty()) {
         logger.logPreferredNeighborsChange(newPreferredNeighbors);
     }
 
-    for (int peerID : newPreferredNeighbors) {
-        if (neighborStates[peerID].amChoking) {
-            neighborStates[peerID].amChoking = false;
-            int sock;
-            {
-                std::lock_guard<std::mutex> lg(socketMutex);
-                sock = peerSockets[peerID];
-            }
-            sendMessage(sock, 1, {}); // unchoke
-            std::cout << "Peer " << peerId << " sent UNCHOKE to peer " << peerID << std::endl;
+    for (int i = 0; i < count; i++) {
+        int slot = candidates[i].first;
+        if (table.has(slot, PeerTable::AmChoking)) {
+            table.set(slot, PeerTable::AmChoking, false);
+            sendMessage(socketOf(table.ids[slot]), 1, {}); // unchoke
+            diagDebug("Peer ", peerId, " sent UNCHOKE to peer ", table.ids[slot]);
         }
     }
 
-    for (auto& [peerID, state] : neighborStates) {
-        bool isPreferred = std::find(newPreferredNeighbors.begin(), newPreferredNeighbors.end(), peerID) != newPreferredNeighbors.end();
-        bool isOptimistic = (peerID == optimisticallyUnchokedNeighbor);
+    for (int slot = 0; slot < table.size(); slot++) {
+        bool isOptimistic = (table.ids[slot] == optimisticallyUnchokedNeighbor);
 
-        if (!isPreferred && !isOptimistic && !state.amChoking) {
-            state.amChoking = true;
-            int sock;
-            {
-                std::lock_guard<std::mutex> lg(socketMutex);
-                sock = peerSockets[peerID];
-            }
-            sendMessage(sock, 0, {}); // choke
-            std::cout << "Peer " << peerId << " sent CHOKE to peer " << peerID << std::endl;
+        if (!preferred[slot] && !isOptimistic && !table.has(slot, PeerTable::AmChoking)) {
+            table.set(slot, PeerTable::AmChoking, true);
+            sendMessage(socketOf(table.ids[slot]), 0, {}); // choke
+            diagDebug("Peer ", peerId, " sent CHOKE to peer ", table.ids[slot]);
         }
     }
-
-    for (auto& [peerID, state] : neighborStates) {
-        state.downloadRate = 0.0;
-        state.bytesDownloaded = 0;
-    }
 }
 
 void Peer::selectOptimisticallyUnchokedNeighbor() {
     std::lock_guard<std::mutex> lock(neighborMutex);
 
-    std::vector<int> candidates;
-    for (auto& [peerID, state] : neighborStates) {
-        if (state.amChoking && state.peerInterested) {
-            candidates.push_back(peerID);
+    std::vector<int> candidates;  // slots
+    for (int slot = 0; slot < table.size(); slot++) {
+        if (table.has(slot, PeerTable::AmChoking) && table.has(slot, PeerTable::PeerInterested)) {
+            candidates.push_back(slot);
         }
     }
 
@@ -884,57 +2232,38 @@ void Peer::selectOptimisticallyUnchokedNeighbor() {
         return;
     }
 
-    int randomIndex = rand() % candidates.size();
-    int selectedPeer = candidates[randomIndex];
+    int randomIndex = chokeRng() % candidates.size();
+    int selectedSlot = candidates[randomIndex];
+    int selectedPeer = table.ids[selectedSlot];
 
     if (optimisticallyUnchokedNeighbor != -1 && optimisticallyUnchokedNeighbor != selectedPeer) {
-        auto& oldState = neighborStates[optimisticallyUnchokedNeighbor];
-        if (!oldState.amChoking) {
-            oldState.amChoking = true;
-            int sock;
-            {
-                std::lock_guard<std::mutex> lg(socketMutex);
-                sock = peerSockets[optimisticallyUnchokedNeighbor];
-            }
-            sendMessage(sock, 0, {}); // choke
-            std::cout << "Peer " << peerId << " sent CHOKE to peer " << optimisticallyUnchokedNeighbor << std::endl;
+        int oldSlot = table.slotOf(optimisticallyUnchokedNeighbor);
+        if (!table.has(oldSlot, PeerTable::AmChoking)) {
+            table.set(oldSlot, PeerTable::AmChoking, true);
+            sendMessage(socketOf(optimisticallyUnchokedNeighbor), 0, {}); // choke
+            diagDebug("Peer ", peerId, " sent CHOKE to peer ", optimisticallyUnchokedNeighbor);
         }
     }
 
     optimisticallyUnchokedNeighbor = selectedPeer;
     logger.logOptimisticallyUnchokedNeighbor(selectedPeer);
 
-    neighborStates[selectedPeer].amChoking = false;
-    int sock;
-    {
-        std::lock_guard<std::mutex> lg(socketMutex);
-        sock = peerSockets[selectedPeer];
-    }
-    sendMessage(sock, 1, {}); // unchoke
-    std::cout << "Peer " << peerId << " sent UNCHOKE to peer " << selectedPeer << std::endl;
-}
-
-void Peer::preferredNeighborTimer() {
-    while (running) {
-        std::this_thread::sleep_for(std::chrono::seconds(unchokingInterval));
-        if (!running) break;
-        selectPreferredNeighbors();
-    }
+    table.set(selectedSlot, PeerTable::AmChoking, false);
+    sendMessage(socketOf(selectedPeer), 1, {}); // unchoke
+    diagDebug("Peer ", peerId, " sent UNCHOKE to peer ", selectedPeer);
 }
 
-void Peer::optimisticUnchokeTimer() {
-    while (running) {
-        std::this_thread::sleep_for(std::chrono::seconds(optimisticUnchokingInterval));
-        if (!running) break;
-        selectOptimisticallyUnchokedNeighbor();
-    }
+void Peer::recordDownload(int remoteID, size_t bytes) {
+    int slot = table.slotOf(remoteID);
+    std::lock_guard<std::mutex> lock(neighborMutex);
+    table.downloaded[slot].add(now(), bytes);
 }
 
-void Peer::updateDownloadRate(int remoteID, size_t bytes) {
+// Counted once a PIECE body is actually written, not when it's queued
+void Peer::recordUpload(int slot, size_t bytes) {
+    if (slot < 0) return;
     std::lock_guard<std::mutex> lock(neighborMutex);
-    neighborStates[remoteID].bytesDownloaded += bytes;
-    neighborStates[remoteID].downloadRate =
-        neighborStates[remoteID].bytesDownloaded / (double)unchokingInterval;
+    table.uploaded[slot].add(now(), bytes);
 }
 
 bool Peer::allPeersComplete() {
@@ -944,20 +2273,7 @@ bool Peer::allPeersComplete() {
 
     std::lock_guard<std::mutex> lock(neighborMutex);
 
-    // ✅ Check if we've heard from ALL peers (not just some)
-    int expectedPeers = peers.size() - 1;  // All except myself
-    if (neighborBitfields.size() < expectedPeers) {
-        return false;  // Haven't heard from everyone yet
-    }
-
-    // Now check if all known peers are complete
-    for (auto& [peerID, bitfield] : neighborBitfields) {
-        for (bool hasPiece : bitfield) {
-            if (!hasPiece) {
-                return false;
-            }
-        }
-    }
-
-    return true;
+    // ✅ heard from ALL peers (not just some) and none of them is missing anything, counted as
+    // their HAVEs and BITFIELDs come in
+    return table.allComplete();
 }
@@ -4,9 +4,28 @@
 #include <thread>
 #include <map>
 #include <set>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <condition_variable>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <chrono>
+#include <atomic>
+#include <random>
 #include "Logger.h"
+#include "EventLoop.h"
+#include "Storage.h"
+#include "PiecePicker.h"
+#include "Bitfield.h"
+#include "FrameReader.h"
+#include "Metadata.h"
+#include "ThreadPool.h"
+#include "ResumeState.h"
+#include "Transport.h"
+#include "PeerTable.h"
+#include "TimerQueue.h"
 
 struct PeerInfo {
     int id;
@@ -17,34 +36,122 @@ struct PeerInfo {
 
 struct Handshake {
     char header[18];     // "P2PFILESHARINGPROJ"
-    char zeros[10];      // all zero
+    char zeros[10];      // all zero except the feature flags in the last byte
     int32_t peerID;      // network byte order
 };
 
-struct Message {
-    uint32_t length;        // includes type byte + payload
-    unsigned char type;     // message ID
-    std::vector<unsigned char> payload;
+// Feature flags carried in the last reserved handshake byte
+constexpr int HS_FLAGS_OFFSET = 27;
+constexpr unsigned char HS_BLOCK_TRANSFER = 0x01;  // REQUEST/PIECE carry a block offset (and length)
+constexpr unsigned char HS_MULTI_HAVE = 0x02;      // understands HAVE_MULTI
+
+// Message type 9: several HAVEs in one frame, the payload is their piece indices (4 bytes each).
+// Only sent to neighbors whose handshake had HS_MULTI_HAVE
+constexpr unsigned char MSG_HAVE_MULTI = 9;
+
+// How sockets are driven: one blocking thread per connection, or a single epoll reactor
+enum class IOMode {
+    Threaded,
+    Reactor
+};
+
+// One frame waiting to be written. A PIECE only queues its header, the body is streamed from the
+// file when it reaches the socket
+struct OutboundFrame {
+    std::vector<unsigned char> bytes;
+    off_t bodyOffset = 0;     // PIECE body as a range of the shared file
+    size_t bodyLength = 0;
+    int pieceIndex = -1;      // PIECE only, so a CANCEL can find it
+    int offset = 0;
+};
+
+// Everything queued for one socket. Any thread may queue, but only the connection's writer (its writer
+// thread, or the reactor) touches the socket, so frames never interleave. Control messages go ahead of
+// PIECE data and are coalesced into a single write
+struct OutboundQueue {
+    int sock = -1;
+    int slot = -1;                      // the neighbor's PeerTable slot, for upload accounting
+    std::mutex mutex;
+    std::condition_variable cv;         // threaded mode: wakes the writer thread
+    std::deque<OutboundFrame> control;  // everything except PIECE
+    std::deque<OutboundFrame> bulk;     // PIECE
+    bool closed = false;
+    bool pending = false;               // reactor mode: handed to the reactor and not drained yet
+    bool idle = true;                   // the writer found both queues empty and has nothing in flight
+    std::condition_variable drainedCv;  // threaded mode: signaled when the writer goes idle
+
+    // writer only: frames taken off the queues and how much of them is on the wire
+    std::vector<OutboundFrame> batch;
+    size_t bytesSent = 0;
+    size_t bodySent = 0;
+};
+
+enum class WriteStatus {
+    Drained,
+    WouldBlock,
+    Failed
+};
+
+// Per-socket receive state, owned by the reactor thread or the connection's thread in threaded mode
+struct Connection {
+    int sock = -1;
+    int remoteID = -1;
+    bool isInitiator = false;
+    bool handshakeDone = false;
+    FrameReader reader;  // bytes received but not parsed yet
 };
 
-struct NeighborState {
-    bool peerChoking = true;      // Is the remote peer choking us
-    bool peerInterested = false;  // Is the remote peer interested in us
-    bool amChoking = true;        // Are we choking them
-    bool amInterested = false;    // Are we interested in them
-    double downloadRate = 0.0; // bytes/sec provided
-    long bytesDownloaded = 0; // For best Neighbor
+// Block level download state of a piece we've started, guarded by requestedPiecesMutex.
+// Without block transfer a piece is a single block
+struct PieceProgress {
+    std::vector<int> blockOwner;  // peer ID each block was requested from, -1 = nobody
+    std::vector<bool> blockDone;
+    int blocksDone = 0;
+    std::set<int> sources;        // peers that delivered blocks, blamed if the hash check fails
+};
+
+// When an outstanding request gives up. Entries are never removed early, one whose request was
+// already answered is just skipped when it comes due
+struct RequestDeadline {
+    std::chrono::steady_clock::time_point when;
+    int peerID;
+    int pieceIndex;
+    int offset;
+
+    bool operator>(const RequestDeadline& other) const { return when > other.when; }
 };
 
 class Peer {
+private:
+    int peerId;  // declared ahead of logger, which reads it while being constructed
+
 public:
-    explicit Peer(int peerId);
+    // With a transport the peer has no sockets, threads or files: whoever owns the transport
+    // drives it through the methods below instead of calling start()
+    explicit Peer(int peerId, Transport* transport = nullptr);
     void start();
     int getPeerId();
+    void seedRandom(unsigned seed);  // every random choice the peer makes, start() seeds from the clock
     Logger logger;
 
+    // Transport mode, all from one thread. conn is the transport's handle for the connection
+    void openTransportConnection(int conn, bool isInitiator);
+    bool receiveTransport(int conn, const unsigned char* data, size_t len);  // false: the peer closed conn
+    void closeTransportConnection(int conn);  // the other end is gone
+    void armTimers();  // schedule the choke rounds, before the first connection
+    std::chrono::steady_clock::time_point nextTimer() { return timers.next(); }
+    void runTimers();  // whatever is due by now()
+    bool isRunning() const { return running; }
+    int getNumPieces() const { return numPieces; }
+    int getPiecesOwned() { return countPiecesOwned(); }
+
 private:
-    int peerId;
+    Transport* transport = nullptr;
+    std::atomic<bool> running{true};  // false once everyone has the file, every loop winds down, set through stop()
+    TimerQueue timers;                // choke rounds, request deadlines, HAVE batches, resume saves
+    std::mutex timerMutex;            // threaded mode, timerLoop() sleeps on timerCv
+    std::condition_variable timerCv;
+    bool timerWake = false;           // timerMutex, something was scheduled ahead of what timerLoop waits for
     std::vector<PeerInfo> peers;
     PeerInfo self;
     int numPreferredNeighbors;
@@ -54,65 +161,171 @@ private:
     long fileSize;
     int pieceSize;
     int numPieces;
-    std::vector<bool> bitfield;
+    IOMode ioMode = IOMode::Threaded;
+    bool asyncLogging = false;
+    bool logToFile = true;         // LogMode off turns the log file off entirely
+    int blockSize = 0;             // bytes per REQUEST when the neighbor supports blocks, 0 = whole pieces only
+    int requestPipelineDepth = 0;  // REQUESTs kept in flight per neighbor, 0 = size from bandwidth-delay product
+    int endgameThreshold = 0;      // remaining pieces at which endgame starts, 0 = never
+    int requestTimeout = 10;       // seconds a request may go unanswered, 0 = wait forever
+    std::string metadataFile;      // piece hashes, relative to Common.cfg. Empty = pieces aren't verified
+    int resumeInterval = 5;        // seconds between resume state saves, 0 = no resume
+    int listenPortOffset = 0;      // listen on our PeerInfo port + this, e.g. with netemProxy on the listed one
+    int haveBatchInterval = 0;     // ms completed pieces wait to be announced together, 0 = HAVE right away
+    int rateWindow = 0;            // seconds the choke rates average over, 0 = the unchoking interval
+    std::vector<int> pendingHaves; // completed pieces not announced yet, bitfieldMutex
+    size_t resumeSavedPieces = 0;  // piece count in the last resume save, timer callbacks and exit only
+    Metadata metadata;
+    std::atomic<bool> inEndgame{false};  // few pieces left, missing blocks are requested from several neighbors
+    Bitfield bitfield;
+    std::atomic<int> piecesOwned{0};             // bits set in bitfield, kept up to date with it
+    std::atomic<bool> downloadComplete{false};   // set once, together with the last bit
     int optimisticallyUnchokedNeighbor = -1;
-    std::unordered_map<int, int> peerSockets;
-    std::unordered_map<int, NeighborState> neighborStates;
-    std::map<int, std::vector<bool>> neighborBitfields;  // peerID -> their bitfield
-    std::map<int, int> requestedPieces; // piece index -> peer ID we requested from
+    PeerTable table;  // per-neighbor state by slot, see PeerTable.h for which lock covers what
+    std::map<int, PieceProgress> piecesInProgress; // piece index -> which blocks are requested/received
+    std::priority_queue<RequestDeadline, std::vector<RequestDeadline>, std::greater<>> requestDeadlines; // requestedPiecesMutex
+    bool requestTimerArmed = false;                          // a timer waits for requestDeadlines, requestedPiecesMutex
+    std::chrono::steady_clock::time_point requestTimerAt;    // when it fires, requestedPiecesMutex
+    std::map<int, std::set<int>> piecesVerifying;            // complete pieces being hashed -> their sources, requestedPiecesMutex
+    std::unordered_map<int, std::set<int>> hashFailures;     // piece -> peers that sent a bad copy, requestedPiecesMutex
+    std::unordered_map<int, int> badPiecesFrom;              // peer -> pieces it sent that failed the hash, requestedPiecesMutex
+    std::map<long, int> blocksReceiving;                     // file offset of a body going straight into the file -> sender, requestedPiecesMutex
+    PiecePicker picker;                           // availability index, guarded by requestedPiecesMutex
+    std::mt19937 pickRng;                         // ties between equally rare pieces, requestedPiecesMutex
+    std::mt19937 chokeRng;                        // choke round order and the optimistic pick, neighborMutex
+    // nested in this order: requestedPiecesMutex, bitfieldMutex, neighborMutex
     std::mutex requestedPiecesMutex;
     std::mutex bitfieldMutex;
     std::mutex neighborMutex;
     std::mutex socketMutex;
+    std::vector<std::shared_ptr<OutboundQueue>> outboundQueues;  // indexed by socket, socketMutex
+    std::vector<std::thread> connectionThreads;  // threaded mode, one per connection, joined on shutdown, socketMutex
+    Storage storage;  // the shared file, opened and mapped once
+    FlushPolicy flushPolicy = FlushPolicy::None;
+
+    // Reactor mode only, touched exclusively by the reactor thread once it runs
+    EventLoop loop;
+    int listenSocket = -1;
+    // Indexed by socket (or transport handle). Both are small ints handed out lowest first, so a
+    // plain array beats hashing on every frame
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::mutex pendingWritesMutex;
+    std::vector<std::shared_ptr<OutboundQueue>> pendingWrites;  // queues with new frames for the reactor
+
+    // last member so its workers are joined before anything they use is torn down
+    ThreadPool hashPool;
 
+    std::chrono::steady_clock::time_point now();  // the transport's clock when there is one
     int loadPeerInfo(const std::string& peerFile);
     int loadCommonConfig(const std::string& configFile);
     void handleConnection(int sock, bool isInitiator);
+    void onHandshakeComplete(int sock, int remoteID, bool isInitiator);
+    int socketOf(int remoteID);
+    void forgetSocket(int remoteID, int sock);
+    std::vector<int> connectedNeighbors();
+    int openListenSocket();
     int listenForPeers();
     int connectToPeers();
+    void stopConnections();
     void sendHandshake(int socket);
     void sendBitfield(int socket);
-    bool receiveHandshake(int socket, int &remotePeerID);
-    bool receiveMessage(int socket, Message &msg);
+    bool parseHandshake(const unsigned char* hs, int &remotePeerID);
+    bool sendAll(int sock, const void* data, size_t len, int flags = 0);
+
+    // Outbound queues
+    std::shared_ptr<OutboundQueue> openOutbound(int sock, int slot);
+    std::shared_ptr<OutboundQueue> outboundFor(int sock);
+    void closeOutbound(int sock);
+    void drainOutbound(int sock, std::chrono::steady_clock::time_point deadline);
+    bool queueFrame(int sock, OutboundFrame frame, bool isBulk);
+    int dropQueuedPieces(int sock, int pieceIndex, int offset);
+    WriteStatus writeQueued(OutboundQueue& q);
+    void writerLoop(std::shared_ptr<OutboundQueue> q);
+
+    // Reactor mode
+    void runReactor();
+    void addConnection(int sock, bool isInitiator);
+    Connection& openConnection(int sock);
+    Connection* connectionFor(int sock);  // nullptr when sock isn't open
+    void acceptPeers();
+    void onReadable(int sock);
+    void onWritable(int sock);
+    void flushPendingWrites();
+    bool processFrames(Connection& conn);
+    size_t maxFrameLength();
+    void closeConnection(int sock);
     bool sendMessage(int socket, unsigned char type, const std::vector<unsigned char>& payload);
     void handleMessage(int remoteID, const Message &msg);
     void handleInterested(int remoteID);
     void handleNotInterested(int remoteID);
     void handleChoke(int remoteID);
     void handleUnchoke(int remoteID);
-    void handleRequest(int remoteID, const std::vector<unsigned char>& payload);
-    void handlePiece(int remoteID, const std::vector<unsigned char>& payload);
-    void handleHave(int remoteID, const std::vector<unsigned char>& payload);
-    void handleBitfield(int remoteID, const std::vector<unsigned char>& payload);
-    ssize_t readNBytes(int sock, void* buffer, size_t n);
+    void handleRequest(int remoteID, const PayloadView& payload);
+    void handlePiece(int remoteID, const PayloadView& payload, size_t placedBytes);
+    unsigned char* pieceDestination(int remoteID, const unsigned char* header, size_t headerLen, size_t bodyLength);
+    void handleHave(int remoteID, const PayloadView& payload);
+    void handleHaveMulti(int remoteID, const PayloadView& payload);
+    void applyHaves(int remoteID, const std::vector<int>& pieces);
+    void handleBitfield(int remoteID, const PayloadView& payload);
+    void handleCancel(int remoteID, const PayloadView& payload);
+    void handleDisconnect(int remoteID);
+    void releaseRequests(int remoteID);
+    void releaseBlock(int remoteID, int pieceIndex, int offset);
 
     // bitfield helpers
     std::vector<unsigned char> bitfieldToBytes(); // convert bitfield to payload bytes
-    std::vector<bool> bytesToBitfield(const std::vector<unsigned char>& payload, int expectedBits);
+    Bitfield bytesToBitfield(const PayloadView& payload, int expectedBits);
 
-    void updateMyBitfield(int pieceIndex); // mark piece downloaded and broadcast HAVE
+    void updateMyBitfield(int pieceIndex); // mark piece downloaded and queue its HAVE
+    void flushHaves();                     // announce the queued HAVEs
+    bool hasPiece(int pieceIndex);  // our bitfield, takes bitfieldMutex
     bool peerHasInterestingPieces(int remoteID);
     void sendInterested(int remoteID);
     void sendNotInterested(int remoteID);
 
     // File handling
-    void savePiece(int pieceIndex, const std::vector<unsigned char>& data);
+    void savePiece(int pieceIndex, const unsigned char* data, size_t len, int offset = 0);
     std::vector<unsigned char> loadPiece(int pieceIndex);
     std::string getPieceFilePath(int pieceIndex);
+    int getPieceLength(int pieceIndex);
+    int transferBlockSize();
+    int blocksInPiece(int pieceIndex);
 
     // Piece exchange
     void requestNextPiece(int remoteID);
-    void sendPiece(int remoteID, int pieceIndex);
-    void broadcastHave(int pieceIndex);
-    int selectRandomPiece(int remoteID);  // Returns -1 if no piece available
+    bool claimNextRequest(int remoteID, int& pieceIndex, int& offset, int& length);
+    bool claimEndgameRequest(int remoteID, int& pieceIndex, int& offset, int& length);
+    void enterEndgameIfNeeded();
+    void cancelDuplicates(int remoteID, int pieceIndex, int offset, bool pieceComplete);
+    void sendCancel(int remoteID, int pieceIndex, int offset, int length);
+    void trackRequest(int remoteID, int pieceIndex, int offset);
+    int pipelineDepth(const RequestPipeline& pipeline, int requestBytes);
+    void checkRequestTimeouts();
+    bool onPieceDelivered(int remoteID, int pieceIndex, int offset, size_t bytes, bool landed);
+    bool pieceWritable(int pieceIndex);
+    bool blockReceiving(long fileOffset);
+    void verifyPiece(int pieceIndex, int remoteID);
+    bool pieceHashMatches(int pieceIndex);
+    void finishPiece(int pieceIndex, int remoteID);
+    void rejectPiece(int pieceIndex);
+    bool avoidSource(int remoteID, int pieceIndex);  // caller holds requestedPiecesMutex
+    void restoreProgress(long priorSize, long long priorMtime);
+    Bitfield verifyExistingPieces();
+    void saveResumeState();
+    std::string getResumeFilePath();
+    void sendPiece(int remoteID, int pieceIndex, int offset, int length);
+    void broadcastHaves(const std::vector<int>& pieces);
+    int selectRarestPiece(int remoteID);  // Returns -1 if no piece available, caller holds requestedPiecesMutex
     bool hasCompletedDownload();
     int countPiecesOwned();
 
     // Choking/unchoking mechanism
     void selectPreferredNeighbors();
     void selectOptimisticallyUnchokedNeighbor();
-    void preferredNeighborTimer();
-    void optimisticUnchokeTimer();
-    void updateDownloadRate(int remoteID, size_t bytes);
+    void stop();
+    void timerLoop();
+    void armRequestTimer();  // caller holds requestedPiecesMutex
+    void recordDownload(int remoteID, size_t bytes);
+    void recordUpload(int slot, size_t bytes);
     bool allPeersComplete();
 };
\ No newline at end of file
@@ -0,0 +1,441 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <filesystem>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "Metadata.h"
+
+// Swarm benchmark: writes Common.cfg/PeerInfo.cfg and a random file into a run directory, starts
+// one peerProcess per peer on loopback and reports how long the downloads took as JSON.
+// Completion is the first "has downloaded the complete file" line in each peer's log, CPU time and
+// peak RSS come from wait4 when the process exits. With --netem the peers reach each other through
+// netemProxy, which adds latency, rate limits and loss.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int NETEM_PORT_OFFSET = 1000;  // peers listen this far above their PeerInfo port, the proxy on it
+
+struct Options {
+    std::string peerBinary = "./peerProcess";
+    std::string proxyBinary;  // empty = netemProxy next to peerBinary
+    std::string netem;        // netemProxy arguments, empty = no proxy
+    std::string dir = "bench_run";
+    std::string output;  // empty = stdout
+    int peers = 5;
+    int seeds = 1;
+    long fileSize = 20000000;
+    int pieceSize = 32768;
+    int preferred = 3;
+    int portBase = 7600;
+    int staggerMs = 100;
+    int timeoutSec = 120;
+    bool metadata = false;
+    std::vector<std::string> config;  // extra Common.cfg lines
+};
+
+struct PeerRun {
+    int id = 0;
+    bool seed = false;
+    pid_t pid = -1;
+    std::string dir;
+    long logOffset = 0;
+    std::string logTail;      // unfinished last line of the log
+    double completion = -1;   // seconds since the first launch, -1 = never
+    double exitTime = -1;
+    int exitStatus = -1;      // exit code, 128 + signal if killed
+    double cpuUser = 0;
+    double cpuSys = 0;
+    long maxRssKb = 0;
+    bool fileMatches = false;
+};
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --peer-binary PATH   peerProcess to run (default ./peerProcess)\n"
+              << "  --dir PATH           run directory, peer_<id> folders are recreated (default bench_run)\n"
+              << "  --peers N            peers in the swarm (default 5)\n"
+              << "  --seeds N            of which start with the file (default 1)\n"
+              << "  --file-size BYTES    (default 20000000)\n"
+              << "  --piece-size BYTES   (default 32768)\n"
+              << "  --preferred N        NumberOfPreferredNeighbors (default 3)\n"
+              << "  --config 'Key Value' extra Common.cfg line, repeatable (e.g. 'IOMode reactor')\n"
+              << "  --metadata           hash the file and add MetadataFile\n"
+              << "  --port-base N        peer i listens on N + i (default 7600)\n"
+              << "  --stagger-ms N       delay between launches (default 100)\n"
+              << "  --timeout S          kill the swarm after S seconds (default 120)\n"
+              << "  --netem 'ARGS'       run the peers through netemProxy with these arguments,\n"
+              << "                       e.g. '--latency-ms 40 --rate 2000000 --loss 0.01'\n"
+              << "  --proxy-binary PATH  netemProxy to run (default: next to the peer binary)\n"
+              << "  --output FILE        write the JSON there instead of stdout\n";
+}
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--metadata") {
+            opt.metadata = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--peer-binary") opt.peerBinary = value;
+        else if (arg == "--dir") opt.dir = value;
+        else if (arg == "--output") opt.output = value;
+        else if (arg == "--peers") opt.peers = std::stoi(value);
+        else if (arg == "--seeds") opt.seeds = std::stoi(value);
+        else if (arg == "--file-size") opt.fileSize = std::stol(value);
+        else if (arg == "--piece-size") opt.pieceSize = std::stoi(value);
+        else if (arg == "--preferred") opt.preferred = std::stoi(value);
+        else if (arg == "--config") opt.config.push_back(value);
+        else if (arg == "--port-base") opt.portBase = std::stoi(value);
+        else if (arg == "--stagger-ms") opt.staggerMs = std::stoi(value);
+        else if (arg == "--timeout") opt.timeoutSec = std::stoi(value);
+        else if (arg == "--netem") opt.netem = value;
+        else if (arg == "--proxy-binary") opt.proxyBinary = value;
+        else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (opt.peers < 2 || opt.seeds < 1 || opt.seeds >= opt.peers || opt.fileSize <= 0 || opt.pieceSize <= 0) {
+        std::cerr << "Error: need at least one seed and one downloader, and positive sizes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool writeRandomFile(const std::string& path, long size) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) return false;
+
+    std::mt19937_64 rng(12345);
+    std::vector<uint64_t> chunk(1 << 16);
+    long left = size;
+    while (left > 0) {
+        for (uint64_t& w : chunk) w = rng();
+        long n = std::min<long>(left, chunk.size() * sizeof(uint64_t));
+        file.write((const char*)chunk.data(), n);
+        left -= n;
+    }
+    return (bool)file;
+}
+
+bool filesEqual(const std::string& a, const std::string& b) {
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    if (!fa.is_open() || !fb.is_open()) return false;
+
+    std::vector<char> ba(1 << 20), bb(1 << 20);
+    while (true) {
+        fa.read(ba.data(), ba.size());
+        fb.read(bb.data(), bb.size());
+        if (fa.gcount() != fb.gcount()) return false;
+        if (fa.gcount() == 0) return true;
+        if (memcmp(ba.data(), bb.data(), fa.gcount()) != 0) return false;
+    }
+}
+
+// Fresh run directory: configs, the file in every seed's folder, empty folders for the rest
+bool prepareRun(const Options& opt, std::vector<PeerRun>& runs) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::create_directories(opt.dir, ec);
+
+    std::ofstream common(opt.dir + "/Common.cfg", std::ios::trunc);
+    common << "NumberOfPreferredNeighbors " << opt.preferred << "\n"
+           << "UnchokingInterval 1\n"
+           << "OptimisticUnchokingInterval 2\n"
+           << "FileName thefile\n"
+           << "FileSize " << opt.fileSize << "\n"
+           << "PieceSize " << opt.pieceSize << "\n";
+    for (const std::string& line : opt.config) common << line << "\n";
+    if (!opt.netem.empty()) common << "ListenPortOffset " << NETEM_PORT_OFFSET << "\n";
+
+    std::ofstream peerInfo(opt.dir + "/PeerInfo.cfg", std::ios::trunc);
+    for (int i = 0; i < opt.peers; i++) {
+        PeerRun run;
+        run.id = 1001 + i;
+        run.seed = i < opt.seeds;
+        run.dir = opt.dir + "/peer_" + std::to_string(run.id);
+        peerInfo << run.id << " 127.0.0.1 " << (opt.portBase + i + 1) << " " << (run.seed ? 1 : 0) << "\n";
+
+        fs::remove_all(run.dir, ec);
+        if (!fs::create_directory(run.dir, ec)) {
+            std::cerr << "Error: Cannot create " << run.dir << std::endl;
+            return false;
+        }
+        runs.push_back(run);
+    }
+
+    std::string seedFile = runs[0].dir + "/thefile";
+    if (!writeRandomFile(seedFile, opt.fileSize)) {
+        std::cerr << "Error: Cannot write " << seedFile << std::endl;
+        return false;
+    }
+    for (int i = 1; i < opt.seeds; i++) {
+        if (!fs::copy_file(seedFile, runs[i].dir + "/thefile", ec)) return false;
+    }
+
+    if (opt.metadata) {
+        Metadata metadata;
+        metadata.fileName = "thefile";
+        if (!metadata.build(seedFile, opt.fileSize, opt.pieceSize)) return false;
+        if (!metadata.save(opt.dir + "/thefile.meta")) return false;
+        common << "MetadataFile thefile.meta\n";
+    }
+    return (bool)common && (bool)peerInfo;
+}
+
+pid_t launch(const Options& opt, const PeerRun& run) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    // child: run from peer_<id> like start_all.sh, console output to out.txt
+    if (chdir(run.dir.c_str()) != 0) _exit(127);
+    int out = open("out.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out >= 0) {
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        close(out);
+    }
+    std::string id = std::to_string(run.id);
+    execl(opt.peerBinary.c_str(), opt.peerBinary.c_str(), id.c_str(), (char*)nullptr);
+    _exit(127);
+}
+
+// netemProxy on the PeerInfo ports, returns once it says it is listening on all of them
+pid_t launchProxy(const Options& opt) {
+    int out[2];
+    if (pipe(out) < 0) return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+
+        std::vector<std::string> args = {opt.proxyBinary, "--peer-info", opt.dir + "/PeerInfo.cfg",
+                                         "--offset", std::to_string(NETEM_PORT_OFFSET)};
+        std::istringstream extra(opt.netem);
+        for (std::string arg; extra >> arg;) args.push_back(arg);
+        std::vector<char*> argv;
+        for (std::string& arg : args) argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        execv(opt.proxyBinary.c_str(), argv.data());
+        _exit(127);
+    }
+    close(out[1]);
+    if (pid < 0) {
+        close(out[0]);
+        return -1;
+    }
+
+    char c;
+    std::string line;
+    while (read(out[0], &c, 1) == 1 && c != '\n') line += c;
+    close(out[0]);
+    if (line != "ready") {
+        std::cerr << "Error: netemProxy didn't start" << std::endl;
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        return -1;
+    }
+    return pid;
+}
+
+// New complete lines of the peer's log, checked for the completion line
+void scanLog(PeerRun& run, double now) {
+    std::ifstream log(run.dir + "/log_peer_" + std::to_string(run.id) + ".log", std::ios::binary);
+    if (!log.is_open()) return;
+    log.seekg(run.logOffset);
+
+    std::string chunk((std::istreambuf_iterator<char>(log)), std::istreambuf_iterator<char>());
+    run.logOffset += chunk.size();
+    run.logTail += chunk;
+
+    size_t end = run.logTail.rfind('\n');
+    if (end == std::string::npos) return;
+    if (run.logTail.find("has downloaded the complete file", 0) < end) run.completion = now;
+    run.logTail.erase(0, end + 1);
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return -1;
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p * values.size());
+    return values[std::max<size_t>(rank, 1) - 1];
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+void writeReport(std::ostream& os, const Options& opt, const std::vector<PeerRun>& runs,
+                 double wallTime, bool timedOut) {
+    std::vector<double> completions;
+    double cpuUser = 0, cpuSys = 0;
+    long peakRss = 0;
+    int completed = 0, verified = 0;
+    for (const PeerRun& run : runs) {
+        cpuUser += run.cpuUser;
+        cpuSys += run.cpuSys;
+        peakRss = std::max(peakRss, run.maxRssKb);
+        if (run.seed) continue;
+        if (run.completion >= 0) {
+            completions.push_back(run.completion);
+            completed++;
+        }
+        if (run.fileMatches) verified++;
+    }
+    int downloaders = opt.peers - opt.seeds;
+    double lastCompletion = completions.empty() ? -1 : *std::max_element(completions.begin(), completions.end());
+    double meanCompletion = completions.empty() ? -1
+        : std::accumulate(completions.begin(), completions.end(), 0.0) / completions.size();
+    double throughput = lastCompletion > 0 ? (double)completed * opt.fileSize / lastCompletion / 1e6 : 0;
+
+    os.setf(std::ios::fixed);
+    os.precision(3);
+    os << "{\n"
+       << "  \"peers\": " << opt.peers << ",\n"
+       << "  \"seeds\": " << opt.seeds << ",\n"
+       << "  \"file_size\": " << opt.fileSize << ",\n"
+       << "  \"piece_size\": " << opt.pieceSize << ",\n"
+       << "  \"metadata\": " << (opt.metadata ? "true" : "false") << ",\n"
+       << "  \"netem\": " << jsonString(opt.netem) << ",\n"
+       << "  \"config\": [";
+    for (size_t i = 0; i < opt.config.size(); i++) os << (i ? ", " : "") << jsonString(opt.config[i]);
+    os << "],\n"
+       << "  \"timed_out\": " << (timedOut ? "true" : "false") << ",\n"
+       << "  \"completed\": " << completed << ",\n"
+       << "  \"verified\": " << verified << ",\n"
+       << "  \"downloaders\": " << downloaders << ",\n"
+       << "  \"total_time_s\": " << lastCompletion << ",\n"
+       << "  \"wall_time_s\": " << wallTime << ",\n"
+       << "  \"completion_s\": {\"min\": " << percentile(completions, 0.0) << ", \"p50\": " << percentile(completions, 0.5)
+       << ", \"p90\": " << percentile(completions, 0.9) << ", \"max\": " << lastCompletion
+       << ", \"mean\": " << meanCompletion << "},\n"
+       << "  \"throughput_mb_s\": " << throughput << ",\n"
+       << "  \"cpu_user_s\": " << cpuUser << ",\n"
+       << "  \"cpu_sys_s\": " << cpuSys << ",\n"
+       << "  \"peak_rss_kb\": " << peakRss << ",\n"
+       << "  \"per_peer\": [\n";
+    for (size_t i = 0; i < runs.size(); i++) {
+        const PeerRun& run = runs[i];
+        os << "    {\"id\": " << run.id << ", \"seed\": " << (run.seed ? "true" : "false")
+           << ", \"completion_s\": " << run.completion << ", \"exit_s\": " << run.exitTime
+           << ", \"exit_status\": " << run.exitStatus << ", \"file_ok\": " << (run.fileMatches ? "true" : "false")
+           << ", \"cpu_user_s\": " << run.cpuUser << ", \"cpu_sys_s\": " << run.cpuSys
+           << ", \"max_rss_kb\": " << run.maxRssKb << "}" << (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) return 1;
+
+    // the peers run from their own folders
+    std::error_code ec;
+    opt.peerBinary = std::filesystem::absolute(opt.peerBinary, ec).string();
+    if (opt.proxyBinary.empty()) {
+        opt.proxyBinary = (std::filesystem::path(opt.peerBinary).parent_path() / "netemProxy").string();
+    }
+
+    std::vector<PeerRun> runs;
+    if (!prepareRun(opt, runs)) return 1;
+
+    pid_t proxy = -1;
+    if (!opt.netem.empty() && (proxy = launchProxy(opt)) < 0) return 1;
+
+    Clock::time_point start = Clock::now();
+    auto elapsed = [&] { return std::chrono::duration<double>(Clock::now() - start).count(); };
+
+    // earlier peers must be listening before later ones connect to them
+    for (PeerRun& run : runs) {
+        run.pid = launch(opt, run);
+        if (run.pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(opt.staggerMs));
+    }
+
+    bool timedOut = false;
+    int running = opt.peers;
+    while (running > 0) {
+        double now = elapsed();
+        for (PeerRun& run : runs) {
+            if (!run.seed && run.completion < 0) scanLog(run, now);
+
+            if (run.pid < 0) continue;
+            int status = 0;
+            rusage usage{};
+            if (wait4(run.pid, &status, WNOHANG, &usage) != run.pid) continue;
+
+            run.pid = -1;
+            run.exitTime = now;
+            run.exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            run.cpuUser = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+            run.cpuSys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+            run.maxRssKb = usage.ru_maxrss;
+            running--;
+        }
+
+        if (running > 0 && now > opt.timeoutSec && !timedOut) {
+            timedOut = true;
+            for (PeerRun& run : runs) {
+                if (run.pid > 0) kill(run.pid, SIGKILL);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double wallTime = elapsed();
+
+    if (proxy > 0) {
+        kill(proxy, SIGTERM);
+        waitpid(proxy, nullptr, 0);
+    }
+
+    // one last look, an async logger writes its final lines on the way out
+    for (PeerRun& run : runs) {
+        if (!run.seed && run.completion < 0) scanLog(run, wallTime);
+        run.fileMatches = run.seed || filesEqual(runs[0].dir + "/thefile", run.dir + "/thefile");
+    }
+
+    if (opt.output.empty()) {
+        writeReport(std::cout, opt, runs, wallTime, timedOut);
+    } else {
+        std::ofstream out(opt.output, std::ios::trunc);
+        writeReport(out, opt, runs, wallTime, timedOut);
+        std::cerr << "Wrote " << opt.output << std::endl;
+    }
+
+    for (const PeerRun& run : runs) {
+        if (!run.seed && !run.fileMatches) return 2;
+    }
+    return timedOut ? 3 : 0;
+}
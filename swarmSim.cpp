@@ -0,0 +1,301 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <unistd.h>
+#include "peer.h"
+#include "SimNetwork.h"
+
+// Swarm simulator: every peer is a real Peer object, but they all live in this process and talk
+// through a SimNetwork on a virtual clock instead of sockets. No data is stored, only which pieces
+// each peer has. Time costs nothing, messages do: hours of choke rounds between few messages run in
+// seconds, while a swarm of 1000 downloading at full speed (one HAVE per piece per neighbor) takes
+// longer than the swarm time it simulates. Same options and --seed, same result. Reports completion
+// times and who uploaded what as JSON.
+
+namespace {
+
+using Clock = SimNetwork::Clock;
+
+struct Options {
+    std::string dir = "sim_run";
+    std::string output;  // empty = stdout
+    int peers = 1000;
+    int seeds = 1;
+    long fileSize = 4 * 1024 * 1024;
+    int pieceSize = 16384;
+    int preferred = 4;
+    int unchokingInterval = 5;
+    int optimisticInterval = 15;
+    int connect = 20;         // connections each peer opens to earlier peers, 0 = all of them
+    double minLatencyMs = 20;
+    double maxLatencyMs = 80;
+    double uploadRate = 1e6;  // bytes/sec per peer
+    int staggerMs = 10;
+    double duration = 36000;  // virtual seconds before giving up
+    unsigned seed = 1;
+    std::vector<std::string> config;  // extra Common.cfg lines
+};
+
+struct SimPeer {
+    std::unique_ptr<Peer> peer;
+    int id = 0;
+    bool seed = false;
+    double completion = -1;  // virtual seconds, -1 = never
+    bool exited = false;
+    Clock::time_point wakeAt = Clock::time_point::max();  // earliest runTimers event we have queued for it
+};
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --dir PATH             where Common.cfg/PeerInfo.cfg are written (default sim_run)\n"
+              << "  --peers N              peers in the swarm (default 1000)\n"
+              << "  --seeds N              of which start with the file (default 1)\n"
+              << "  --file-size BYTES      (default 4194304)\n"
+              << "  --piece-size BYTES     (default 16384)\n"
+              << "  --preferred N          NumberOfPreferredNeighbors (default 4)\n"
+              << "  --unchoking-interval S UnchokingInterval (default 5)\n"
+              << "  --optimistic-interval S OptimisticUnchokingInterval (default 15)\n"
+              << "  --connect N            connections each peer opens to random earlier peers, 0 = all (default 20)\n"
+              << "  --latency-ms MIN MAX   one way latency range, drawn per connection (default 20 80)\n"
+              << "  --upload-rate BYTES    upload bytes/sec per peer, 0 = unlimited (default 1000000)\n"
+              << "  --stagger-ms N         virtual delay between peer starts (default 10)\n"
+              << "  --duration S           give up after S virtual seconds (default 36000)\n"
+              << "  --seed N               random seed (default 1)\n"
+              << "  --config 'Key Value'   extra Common.cfg line, repeatable (e.g. 'BlockSize 16384')\n"
+              << "  --output FILE          write the JSON there instead of stdout\n";
+}
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--dir") opt.dir = value;
+        else if (arg == "--output") opt.output = value;
+        else if (arg == "--peers") opt.peers = std::stoi(value);
+        else if (arg == "--seeds") opt.seeds = std::stoi(value);
+        else if (arg == "--file-size") opt.fileSize = std::stol(value);
+        else if (arg == "--piece-size") opt.pieceSize = std::stoi(value);
+        else if (arg == "--preferred") opt.preferred = std::stoi(value);
+        else if (arg == "--unchoking-interval") opt.unchokingInterval = std::stoi(value);
+        else if (arg == "--optimistic-interval") opt.optimisticInterval = std::stoi(value);
+        else if (arg == "--connect") opt.connect = std::stoi(value);
+        else if (arg == "--latency-ms" && i + 1 < argc) {
+            opt.minLatencyMs = std::stod(value);
+            opt.maxLatencyMs = std::stod(argv[++i]);
+        }
+        else if (arg == "--upload-rate") opt.uploadRate = std::stod(value);
+        else if (arg == "--stagger-ms") opt.staggerMs = std::stoi(value);
+        else if (arg == "--duration") opt.duration = std::stod(value);
+        else if (arg == "--seed") opt.seed = std::stoul(value);
+        else if (arg == "--config") opt.config.push_back(value);
+        else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (opt.peers < 2 || opt.seeds < 1 || opt.seeds >= opt.peers || opt.fileSize <= 0 || opt.pieceSize <= 0 ||
+        opt.unchokingInterval <= 0 || opt.optimisticInterval <= 0) {
+        std::cerr << "Error: need at least one seed and one downloader, and positive sizes and intervals" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The peers read ../Common.cfg and ../PeerInfo.cfg, so they run from <dir>/peers
+bool prepareRun(const Options& opt) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::create_directories(opt.dir + "/peers", ec);
+
+    // no log files or console chatter by default, --config lines come later and win
+    std::ofstream common(opt.dir + "/Common.cfg", std::ios::trunc);
+    common << "NumberOfPreferredNeighbors " << opt.preferred << "\n"
+           << "UnchokingInterval " << opt.unchokingInterval << "\n"
+           << "OptimisticUnchokingInterval " << opt.optimisticInterval << "\n"
+           << "FileName thefile\n"
+           << "FileSize " << opt.fileSize << "\n"
+           << "PieceSize " << opt.pieceSize << "\n"
+           << "LogMode off\n"
+           << "DiagLevel error\n"
+           << "ResumeInterval 0\n";
+    for (const std::string& line : opt.config) {
+        // pieces are never hashed, there is no data
+        if (line.rfind("MetadataFile", 0) == 0) {
+            std::cerr << "Warning: ignoring '" << line << "', simulated peers don't store data" << std::endl;
+            continue;
+        }
+        common << line << "\n";
+    }
+
+    std::ofstream peerInfo(opt.dir + "/PeerInfo.cfg", std::ios::trunc);
+    for (int i = 0; i < opt.peers; i++) {
+        peerInfo << (1001 + i) << " 127.0.0.1 0 " << (i < opt.seeds ? 1 : 0) << "\n";
+    }
+    if (!common || !peerInfo) {
+        std::cerr << "Error: Cannot write the configs in " << opt.dir << std::endl;
+        return false;
+    }
+    return chdir((opt.dir + "/peers").c_str()) == 0;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return -1;
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p * values.size());
+    return values[std::max<size_t>(rank, 1) - 1];
+}
+
+void writeReport(std::ostream& os, const Options& opt, const std::vector<SimPeer>& sim, const SimNetwork& net,
+                 double virtualTime, double wallTime) {
+    std::vector<double> completions;
+    uint64_t pieceBytes = 0, seedPieceBytes = 0;
+    for (const SimPeer& p : sim) {
+        auto sent = net.pieceBytesSent.find(p.id);
+        uint64_t uploaded = sent == net.pieceBytesSent.end() ? 0 : sent->second;
+        pieceBytes += uploaded;
+        if (p.seed) seedPieceBytes += uploaded;
+        else if (p.completion >= 0) completions.push_back(p.completion);
+    }
+    int downloaders = opt.peers - opt.seeds;
+    double lastCompletion = completions.empty() ? -1 : *std::max_element(completions.begin(), completions.end());
+    double meanCompletion = completions.empty() ? -1
+        : std::accumulate(completions.begin(), completions.end(), 0.0) / completions.size();
+    // PIECE bytes on the wire per byte the downloaders needed, above 1 is endgame duplicates and headers
+    double overhead = downloaders > 0 ? (double)pieceBytes / ((double)downloaders * opt.fileSize) : 0;
+
+    os.setf(std::ios::fixed);
+    os.precision(3);
+    os << "{\n"
+       << "  \"peers\": " << opt.peers << ",\n"
+       << "  \"seeds\": " << opt.seeds << ",\n"
+       << "  \"file_size\": " << opt.fileSize << ",\n"
+       << "  \"piece_size\": " << opt.pieceSize << ",\n"
+       << "  \"connect\": " << opt.connect << ",\n"
+       << "  \"upload_rate\": " << opt.uploadRate << ",\n"
+       << "  \"seed\": " << opt.seed << ",\n"
+       << "  \"completed\": " << completions.size() << ",\n"
+       << "  \"downloaders\": " << downloaders << ",\n"
+       << "  \"virtual_time_s\": " << virtualTime << ",\n"
+       << "  \"wall_time_s\": " << wallTime << ",\n"
+       << "  \"events\": " << net.eventsRun << ",\n"
+       << "  \"completion_s\": {\"min\": " << percentile(completions, 0.0) << ", \"p50\": " << percentile(completions, 0.5)
+       << ", \"p90\": " << percentile(completions, 0.9) << ", \"max\": " << lastCompletion
+       << ", \"mean\": " << meanCompletion << "},\n"
+       << "  \"bytes_sent\": " << net.bytesSent << ",\n"
+       << "  \"piece_bytes\": " << pieceBytes << ",\n"
+       << "  \"seed_upload_share\": " << (pieceBytes ? (double)seedPieceBytes / pieceBytes : 0) << ",\n"
+       << "  \"piece_overhead\": " << overhead << ",\n"
+       << "  \"per_peer\": [\n";
+    for (size_t i = 0; i < sim.size(); i++) {
+        const SimPeer& p = sim[i];
+        auto sent = net.pieceBytesSent.find(p.id);
+        os << "    {\"id\": " << p.id << ", \"seed\": " << (p.seed ? "true" : "false")
+           << ", \"completion_s\": " << p.completion
+           << ", \"uploaded\": " << (sent == net.pieceBytesSent.end() ? 0 : sent->second) << "}"
+           << (i + 1 < sim.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) return 1;
+
+    std::error_code ec;
+    if (!opt.output.empty()) opt.output = std::filesystem::absolute(opt.output, ec).string();
+    if (!prepareRun(opt)) return 1;
+
+    auto wallStart = std::chrono::steady_clock::now();
+
+    SimNetwork::Options netOpt;
+    netOpt.minLatency = opt.minLatencyMs / 1000.0;
+    netOpt.maxLatency = opt.maxLatencyMs / 1000.0;
+    netOpt.uploadRate = opt.uploadRate;
+    netOpt.seed = opt.seed;
+    SimNetwork net(netOpt);
+
+    // connect order here, and each peer's own random choices (piece ties, choke rounds) are seeded from it
+    std::mt19937 rng(opt.seed);
+
+    std::vector<SimPeer> sim(opt.peers);
+    for (int i = 0; i < opt.peers; i++) {
+        sim[i].id = 1001 + i;
+        sim[i].seed = i < opt.seeds;
+        sim[i].peer = std::make_unique<Peer>(sim[i].id, net.port(sim[i].id));
+        sim[i].peer->seedRandom(rng());
+        net.addPeer(sim[i].id, sim[i].peer.get());
+    }
+
+    // every event can schedule peer timers, keep an event queued for the earliest one
+    auto armWake = [&net](SimPeer& p) {
+        Clock::time_point next = p.peer->nextTimer();
+        if (next >= p.wakeAt) return;
+        p.wakeAt = next;
+        net.schedule(next, p.id, [&p, next] {
+            if (p.wakeAt == next) p.wakeAt = Clock::time_point::max();
+            if (p.peer->isRunning()) p.peer->runTimers();
+        });
+    };
+
+    int remaining = opt.peers - opt.seeds;
+    net.afterEvent = [&](int peerID) {
+        SimPeer& p = sim[peerID - 1001];
+        if (p.completion < 0 && !p.seed && p.peer->getPiecesOwned() == p.peer->getNumPieces()) {
+            p.completion = net.seconds();
+            remaining--;
+        }
+        // a peer that stopped (everyone it knows of is done) exits like the real process
+        if (!p.exited && !p.peer->isRunning()) {
+            p.exited = true;
+            net.disconnectPeer(p.id);
+        }
+        if (!p.exited) armWake(p);
+    };
+
+    // peers start one after another and connect to earlier ones, like start_all.sh
+    for (int i = 0; i < opt.peers; i++) {
+        Clock::time_point startAt = net.start() + std::chrono::milliseconds((long)opt.staggerMs * i);
+        int id = sim[i].id;
+        Peer* peer = sim[i].peer.get();
+
+        net.schedule(startAt, id, [&net, &rng, &opt, i, id, peer] {
+            peer->armTimers();
+            std::vector<int> earlier(i);
+            std::iota(earlier.begin(), earlier.end(), 1001);
+            if (opt.connect > 0 && i > opt.connect) {
+                std::shuffle(earlier.begin(), earlier.end(), rng);
+                earlier.resize(opt.connect);
+            }
+            for (int other : earlier) net.connect(id, other);
+        });
+    }
+
+    Clock::time_point until = net.start() + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(opt.duration));
+    net.run(until, [&] { return remaining == 0; });
+
+    double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    if (opt.output.empty()) {
+        writeReport(std::cout, opt, sim, net, net.seconds(), wallTime);
+    } else {
+        std::ofstream out(opt.output, std::ios::trunc);
+        writeReport(out, opt, sim, net, net.seconds(), wallTime);
+        std::cerr << "Wrote " << opt.output << std::endl;
+    }
+    return remaining == 0 ? 0 : 3;
+}